@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Regression checks. Each case assembles nothing: the image is given as hex
+# bytes loaded at 0x0300, and the emulator's output is matched against a
+# pattern.
+
+SRC=$(cd $(dirname $0) && pwd)/main.cpp
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+g++ $SRC -o $DIR/emu -pthread -ldl -DRUN6502_SOURCE="\"$SRC\"" || exit 1
+cd $DIR
+FAILED=0
+
+# check NAME HEX PATTERN [OPTIONS...]
+check()
+{
+    echo "$2" | xxd -r -p > out.bin
+    if ./emu 0x0300 "${@:4}" 2>&1 | grep -q "$3"
+    then
+        echo "ok     $1"
+    else
+        echo "FAILED $1"
+        FAILED=1
+    fi
+}
+
+# A zero page write on the slow path lands in RAM when no timer is mapped.
+check "zero page write with -sanitize" "A942850285206000" "^00 00 42 00" -sanitize
+
+# Page 0 is classified as data once written.
+check "zero page classified as data with -pages" "A942850285206000" "^\$0000-\$00FF data" -pages
+
+# Every timing run starts from the loaded image.
+check "input independent routine is constant time" "A530D002E631A901853060" "constant time$" -timing -in b:0010=0-3
+
+# A 3-byte branch on bit to itself is a loop.
+check "BBR to itself stops with -exit loop" "0F10FD" "^PC : 0x0300" -cpu r65c02 -exit loop -cycles 1000000
+
+# The first write to a shared zero page copies it for the machine writing it.
+check "first write to a shared page with -sparse" "A942850285308503A502D0010060" "^4 stopped on exit" -machines 4 -sparse -exit brk -exit rts
+
+# Checkpoints see every dirty page, and a rewound run ends the same way.
+check "checkpointed run reaches its exit" "A942850285308503A502D0010060" "^PC : 0x030E" -checkpoint 4 -exit brk -exit rts
+check "checkpointed run replays from a rewind" "A942850285308503A502D0010060" "^running again from checkpoint 1 matches" -checkpoint 4 -exit brk -exit rts
+
+# Translated code falls through only to the instruction that follows, not to
+# one hidden in the operand of a BIT abs that skips it.
+check "overlapping instructions run natively" "389003A9052CA907851060" "^05 00 00" -exit rts -cache $DIR/cache
+
+# Exits and breakpoints inside translated code still stop it.
+check "-exit pc: stops native code" "A9018510A902851160" "^01 00 00" -exit pc:0304 -cycles 1000000 -cache $DIR/cache
+check "-break stops native code" "A9018510A902851160" "^STOP: breakpoint at \$0304" -break 0304 -cycles 1000000 -cache $DIR/cache
+
+# Each pooled machine keeps its own interrupt schedule: the IRQ handler at
+# $0304, reached through the vector at $FFFE, ends every run after 1012 cycles.
+check "pooled machines keep their own IRQ schedule" "584C0103E61040$(printf '%0129518d' 0)0403" "^RUN: 4048 cycles" -machines 4:4 -threads 1 -irq 1000 -exit write:0010
+
+# Input grids too large to keep a result for every run are refused.
+check "sweep over three words is rejected" "60" "^error: sweep inputs" -in w:0010=0-65535 -in w:0012=0-65535 -in w:0014=0-65535
+check "-threads takes a number" "60" "^error: -threads" -threads zz -in b:0010=0-1
+
+# A -break before the save point is reported instead of saving there.
+check "-break before -save-at pc: is not saved" "A9018510A902851160" "^STOP: breakpoint at \$0304 after .* before the save point" -break 0304 -save s.state -save-at pc:0306
+
+# Breakpoint addresses and condition constants are range checked.
+check "-break zz is rejected" "60" "^error: -break" -break zz
+check "-break past FFFF is rejected" "60" "^error: -break" -break 10000
+check "-break condition constant past 32 bits is rejected" "60" "number out of range" -break "0300:A==0x100000000"
+
+# A real-time slice rate of 0 is refused rather than divided by.
+check "-slice 0 is rejected" "60" "^error: -slice" -mhz 1 -slice 0
+
+exit $FAILED
@@ -11,6 +11,28 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define NEGATIVE  0x80
 #define OVERFLOW  0x40
@@ -39,8 +61,698 @@
 #define IF_ZERO() ((status & ZERO) ? true : false)
 #define IF_CARRY() ((status & CARRY) ? true : false)
 
+// CPU models. The CMOS parts fix the NMOS bugs and add instructions, the
+// Rockwell and WDC parts add the bit instructions and WDC adds WAI and STP.
+enum CpuModel { NMOS_6502, CMOS_65C02, ROCKWELL_65C02, WDC_65C02 };
+
+// Why Run returned.
+enum StopReason
+{
+    STOP_NONE,
+    STOP_BUDGET,     // Ran out of cycles.
+    STOP_DEADLINE,   // Ran out of wall clock time.
+    STOP_ILLEGAL,    // Illegal opcode at stopPc.
+    STOP_BRK,        // BRK at stopPc.
+    STOP_EXIT,       // An exit condition was met at stopPc.
+    STOP_BREAKPOINT, // A breakpoint was hit at stopPc.
+    STOP_WATCHPOINT, // A stopping watchpoint was hit by the instruction at stopPc.
+    STOP_STP,        // STP at stopPc, only a reset restarts the CPU.
+    STOP_WAIT,       // Waiting for an interrupt that is never coming.
+    STOP_MEMORY,     // No memory left for a page written at stopPc.
+};
+
+static const char* StopReasonName(StopReason reason)
+{
+    switch(reason)
+    {
+    case STOP_NONE: return "none";
+    case STOP_BUDGET: return "cycle budget exhausted";
+    case STOP_DEADLINE: return "deadline passed";
+    case STOP_ILLEGAL: return "illegal opcode";
+    case STOP_BRK: return "BRK";
+    case STOP_EXIT: return "exit condition";
+    case STOP_BREAKPOINT: return "breakpoint";
+    case STOP_WATCHPOINT: return "watchpoint";
+    case STOP_STP: return "STP";
+    case STOP_WAIT: return "waiting with no interrupt scheduled";
+    case STOP_MEMORY: return "out of memory";
+    }
+    return "unknown";
+}
+
+// A machine's registers, flags and cycle count apart from the engine that
+// runs it, so that one mos6502 can run any number of machines in turn. The
+// last StopReason is kept above the STATE_ bits.
+struct CpuState
+{
+    enum { STATE_WAITING = 1, STATE_STOPPED = 2, STATE_IRQ = 4, STATE_BITS = 3 };
+    uint64_t cycleCount;
+    uint16_t pc;
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t sp;
+    uint8_t status;
+    uint8_t flags;
+
+    StopReason Reason() const
+    {
+        return (StopReason) (flags >> STATE_BITS);
+    }
+};
+static_assert(sizeof(CpuState) == 16, "CpuState is meant to pack four to a cache line");
+
+// Bump allocator over large anonymous mappings, so that many small objects
+// share few TLB entries. Chunks get explicit 2MB pages where the host has
+// them reserved, and are otherwise offered to transparent huge pages.
+struct Arena
+{
+    static constexpr size_t hugePage = 2 << 20;
+    static constexpr size_t chunkSize = 64 << 20;
+    std::vector<std::pair<uint8_t*, size_t> > chunks;
+    size_t used = 0;
+    size_t reserved = 0;
+    bool hugetlb = false;
+    std::mutex lock;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        for(const auto& chunk : chunks)
+        {
+            munmap(chunk.first, chunk.second);
+        }
+    }
+
+    void* Allocate(size_t bytes, size_t align = 64)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if(chunks.empty() || offset + bytes > chunks.back().second)
+        {
+            size_t size = (std::max(bytes, chunkSize) + hugePage - 1) & ~(hugePage - 1);
+            void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(base != MAP_FAILED)
+            {
+                hugetlb = true;
+            }
+            else
+            {
+                base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(base == MAP_FAILED)
+                {
+                    return NULL;
+                }
+                madvise(base, size, MADV_HUGEPAGE);
+            }
+            chunks.push_back({ (uint8_t*) base, size });
+            reserved += size;
+            offset = 0;
+        }
+        used = offset + bytes;
+        return chunks.back().first + offset;
+    }
+};
+
+// A 64K image shared read-only by any number of SparseMemory. Pages that
+// are all zeros point at the one shared zero page.
+struct SharedImage
+{
+    uint8_t* pages[256];
+
+    static uint8_t* ZeroPage()
+    {
+        alignas(256) static uint8_t zero[256];
+        return zero;
+    }
+
+    // The image must outlive everything sharing it.
+    void Share(uint8_t* image)
+    {
+        for(int page = 0; page < 256; page++)
+        {
+            uint8_t* data = image + page * 256;
+            pages[page] = data[0] == 0 && memcmp(data, data + 1, 255) == 0 ? ZeroPage() : data;
+        }
+    }
+};
+
+// Guest memory whose pages are shared until written. The first write to a
+// page copies it to one of its own from the arena, so memory grows with the
+// pages written rather than the address space. Private pages are listed in
+// page order, found by the rank of their bit.
+struct SparseMemory
+{
+    const SharedImage* image;
+    Arena* arena;
+    uint8_t** owned;
+    uint64_t bits[4];
+    uint16_t count;
+    uint16_t capacity;
+
+    void Share(const SharedImage& image, Arena& arena)
+    {
+        this->image = &image;
+        this->arena = &arena;
+        owned = NULL;
+        memset(bits, 0, sizeof(bits));
+        count = 0;
+        capacity = 0;
+    }
+
+    bool Owned(uint8_t page) const
+    {
+        return bits[page >> 6] >> (page & 63) & 1;
+    }
+
+    int Rank(uint8_t page) const
+    {
+        int rank = 0;
+        for(int i = 0; i < page >> 6; i++)
+        {
+            rank += __builtin_popcountll(bits[i]);
+        }
+        return rank + __builtin_popcountll(bits[page >> 6] & ((1ull << (page & 63)) - 1));
+    }
+
+    uint8_t* Page(uint8_t page) const
+    {
+        return Owned(page) ? owned[Rank(page)] : image->pages[page];
+    }
+
+    // Gives the page a private copy. NULL when the arena is exhausted.
+    uint8_t* Own(uint8_t page)
+    {
+        int rank = Rank(page);
+        if(Owned(page))
+        {
+            return owned[rank];
+        }
+        uint8_t* copy = (uint8_t*) arena->Allocate(256, 256);
+        if(copy == NULL)
+        {
+            return NULL;
+        }
+        if(count == capacity)
+        {
+            // The outgrown list stays behind in the arena.
+            uint16_t grown = capacity ? capacity * 2 : 4;
+            uint8_t** list = (uint8_t**) arena->Allocate(grown * sizeof(uint8_t*), sizeof(uint8_t*));
+            if(list == NULL)
+            {
+                return NULL;
+            }
+            memcpy(list, owned, count * sizeof(uint8_t*));
+            owned = list;
+            capacity = grown;
+        }
+        memcpy(copy, image->pages[page], 256);
+        memmove(owned + rank + 1, owned + rank, (count - rank) * sizeof(uint8_t*));
+        owned[rank] = copy;
+        count++;
+        bits[page >> 6] |= 1ull << (page & 63);
+        return copy;
+    }
+};
+
+// Comparison and hashing of 64K memory snapshots. Diffs compare 32 bytes
+// at a time with AVX2, or 16 with SSE2, and only look at single bytes in
+// the blocks that changed. Page hashes are CRC-32C, computed with the
+// SSE4.2 instruction where there is one and from a table otherwise, so
+// they agree between hosts.
+struct MemoryRange
+{
+    uint16_t first;
+    uint16_t last;
+};
+
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static void DiffMasksAvx2(const uint8_t* a, const uint8_t* b, uint32_t* masks)
+{
+    for(int i = 0; i < 2048; i++)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + i * 32));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + i * 32));
+        masks[i] = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    }
+}
+
+static void DiffMasksSse2(const uint8_t* a, const uint8_t* b, uint32_t* masks)
+{
+    for(int i = 0; i < 2048; i++)
+    {
+        __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i * 32)), _mm_loadu_si128((const __m128i*) (b + i * 32)));
+        __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i * 32 + 16)), _mm_loadu_si128((const __m128i*) (b + i * 32 + 16)));
+        masks[i] = ~((uint32_t) _mm_movemask_epi8(lo) | (uint32_t) _mm_movemask_epi8(hi) << 16);
+    }
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(const uint8_t* data, size_t size, uint32_t crc)
+{
+    uint64_t state = ~crc;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        state = _mm_crc32_u64(state, word);
+    }
+    for(; i < size; i++)
+    {
+        state = _mm_crc32_u8(state, data[i]);
+    }
+    return ~state;
+}
+#endif
+
+// One bit per byte that differs, a word per 32 bytes.
+inline void DiffMasks(const uint8_t* a, const uint8_t* b, uint32_t* masks)
+{
+#ifdef __x86_64__
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if(avx2)
+    {
+        DiffMasksAvx2(a, b, masks);
+    }
+    else
+    {
+        DiffMasksSse2(a, b, masks);
+    }
+#else
+    for(int i = 0; i < 2048; i++)
+    {
+        masks[i] = 0;
+        for(int j = 0; j < 32; j++)
+        {
+            masks[i] |= (uint32_t) (a[i * 32 + j] != b[i * 32 + j]) << j;
+        }
+    }
+#endif
+}
+
+// The inclusive ranges of addresses at which two snapshots differ.
+inline std::vector<MemoryRange> DiffSnapshots(const uint8_t* a, const uint8_t* b)
+{
+    uint32_t masks[2048];
+    DiffMasks(a, b, masks);
+    std::vector<MemoryRange> ranges;
+    int32_t first = -1;
+    for(int i = 0; i < 2048; i++)
+    {
+        uint32_t mask = masks[i];
+        if(mask == (first < 0 ? 0 : 0xFFFFFFFF))
+        {
+            continue;
+        }
+        for(int j = 0; j < 32; j++)
+        {
+            bool changed = mask >> j & 1;
+            if(changed && first < 0)
+            {
+                first = i * 32 + j;
+            }
+            else if(!changed && first >= 0)
+            {
+                ranges.push_back({ (uint16_t) first, (uint16_t) (i * 32 + j - 1) });
+                first = -1;
+            }
+        }
+    }
+    if(first >= 0)
+    {
+        ranges.push_back({ (uint16_t) first, 0xFFFF });
+    }
+    return ranges;
+}
+
+// CRC-32C, continuing from crc.
+inline uint32_t Crc32c(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+#ifdef __x86_64__
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if(sse42)
+    {
+        return Crc32cSse42(data, size, crc);
+    }
+#endif
+    static uint32_t table[256];
+    static const bool built = []()
+    {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t entry = i;
+            for(int k = 0; k < 8; k++)
+            {
+                entry = entry & 1 ? (entry >> 1) ^ 0x82F63B78 : entry >> 1;
+            }
+            table[i] = entry;
+        }
+        return true;
+    }();
+    (void) built;
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// CRC-32C of each page of a snapshot. Returns that of the page hashes, which
+// stands for the whole snapshot.
+inline uint32_t HashSnapshot(const uint8_t* image, uint32_t hashes[256])
+{
+    for(int page = 0; page < 256; page++)
+    {
+        hashes[page] = Crc32c(image + page * 256, 256);
+    }
+    return Crc32c((const uint8_t*) hashes, 256 * sizeof(uint32_t));
+}
+
+// PackBits style run-length coding. A control byte below 0x80 copies the
+// next control + 1 bytes, one from 0x80 repeats the next byte control - 0x7D
+// times.
+inline void RleEncode(const uint8_t* in, size_t size, std::vector<uint8_t>& out)
+{
+    size_t i = 0;
+    while(i < size)
+    {
+        size_t run = 1;
+        while(i + run < size && run < 130 && in[i + run] == in[i])
+        {
+            run++;
+        }
+        if(run >= 3)
+        {
+            out.push_back(0x80 + run - 3);
+            out.push_back(in[i]);
+            i += run;
+            continue;
+        }
+        size_t literals = 0;
+        while(i + literals < size && literals < 128)
+        {
+            const uint8_t* p = in + i + literals;
+            if(i + literals + 2 < size && p[0] == p[1] && p[0] == p[2])
+            {
+                break;
+            }
+            literals++;
+        }
+        out.push_back(literals - 1);
+        out.insert(out.end(), in + i, in + i + literals);
+        i += literals;
+    }
+}
+
+// Decodes size bytes and returns where the encoding ends.
+inline const uint8_t* RleDecode(const uint8_t* in, uint8_t* out, size_t size)
+{
+    for(size_t i = 0; i < size;)
+    {
+        uint8_t control = *in++;
+        if(control < 0x80)
+        {
+            memcpy(out + i, in, control + 1);
+            in += control + 1;
+            i += control + 1;
+        }
+        else
+        {
+            memset(out + i, *in++, control - 0x7D);
+            i += control - 0x7D;
+        }
+    }
+    return in;
+}
+
+// A breakpoint condition such as "A == $10 && [$0200] != 0", compiled to
+// bytecode for a small stack machine. Registers are A, X, Y, SP, P and PC,
+// [addr] reads a byte of memory and numbers are decimal or $ or 0x hex.
+// Operators are those of C, with the logical ones not short circuiting.
+struct Condition
+{
+    enum Op
+    {
+        PUSH, REG_A, REG_X, REG_Y, REG_SP, REG_P, REG_PC, LOAD,
+        NOT, NEG, INV, ADD, SUB, AND, OR, XOR, EQ, NE, LT, LE, GT, GE, LAND, LOR,
+    };
+
+    static const int maxDepth = 32;
+
+    // Ops, each PUSH followed by its operand. Empty, from an empty
+    // expression, is always true.
+    std::vector<int32_t> code;
+    const char* error;
+
+    bool Compile(const char* text)
+    {
+        code.clear();
+        error = NULL;
+        p = text;
+        Skip();
+        if(!*p)
+        {
+            return true;
+        }
+        ParseOr();
+        Skip();
+        if(!error && *p)
+        {
+            error = "unexpected trailing characters";
+        }
+        int depth = 0;
+        for(size_t i = 0; !error && i < code.size(); i++)
+        {
+            switch(code[i])
+            {
+            case PUSH: depth++; i++; break;
+            case REG_A: case REG_X: case REG_Y: case REG_SP: case REG_P: case REG_PC: depth++; break;
+            case LOAD: case NOT: case NEG: case INV: break;
+            default: depth--; break;
+            }
+            if(depth > maxDepth)
+            {
+                error = "expression too deep";
+            }
+        }
+        return error == NULL;
+    }
+
+    template<typename Cpu>
+    bool Eval(Cpu& cpu) const
+    {
+        int32_t stack[maxDepth];
+        int top = -1;
+        if(code.empty())
+        {
+            return true;
+        }
+        for(size_t i = 0; i < code.size(); i++)
+        {
+            int32_t b;
+            switch(code[i])
+            {
+            case PUSH: stack[++top] = code[++i]; continue;
+            case REG_A: stack[++top] = cpu.A; continue;
+            case REG_X: stack[++top] = cpu.X; continue;
+            case REG_Y: stack[++top] = cpu.Y; continue;
+            case REG_SP: stack[++top] = cpu.sp; continue;
+            case REG_P: stack[++top] = cpu.status; continue;
+            case REG_PC: stack[++top] = cpu.pc; continue;
+            case LOAD: stack[top] = cpu.Peek(stack[top] & 0xFFFF); continue;
+            case NOT: stack[top] = !stack[top]; continue;
+            case NEG: stack[top] = -stack[top]; continue;
+            case INV: stack[top] = ~stack[top]; continue;
+            }
+            b = stack[top--];
+            int32_t& a = stack[top];
+            switch(code[i])
+            {
+            case ADD: a = a + b; break;
+            case SUB: a = a - b; break;
+            case AND: a = a & b; break;
+            case OR: a = a | b; break;
+            case XOR: a = a ^ b; break;
+            case EQ: a = a == b; break;
+            case NE: a = a != b; break;
+            case LT: a = a < b; break;
+            case LE: a = a <= b; break;
+            case GT: a = a > b; break;
+            case GE: a = a >= b; break;
+            case LAND: a = a && b; break;
+            case LOR: a = a || b; break;
+            }
+        }
+        return stack[0] != 0;
+    }
+
+private:
+    const char* p;
+
+    void Skip()
+    {
+        while(*p == ' ' || *p == '\t') p++;
+    }
+
+    bool Accept(const char* token)
+    {
+        Skip();
+        size_t n = strlen(token);
+        if(strncmp(p, token, n) == 0)
+        {
+            p += n;
+            return true;
+        }
+        return false;
+    }
+
+    void ParseOr()
+    {
+        ParseAnd();
+        while(!error && Accept("||")) { ParseAnd(); code.push_back(LOR); }
+    }
+
+    void ParseAnd()
+    {
+        ParseBitOr();
+        while(!error && Accept("&&")) { ParseBitOr(); code.push_back(LAND); }
+    }
+
+    void ParseBitOr()
+    {
+        ParseXor();
+        while(!error)
+        {
+            Skip();
+            if(p[0] != '|' || p[1] == '|') break;
+            p++;
+            ParseXor();
+            code.push_back(OR);
+        }
+    }
+
+    void ParseXor()
+    {
+        ParseBitAnd();
+        while(!error && Accept("^")) { ParseBitAnd(); code.push_back(XOR); }
+    }
+
+    void ParseBitAnd()
+    {
+        ParseEquality();
+        while(!error)
+        {
+            Skip();
+            if(p[0] != '&' || p[1] == '&') break;
+            p++;
+            ParseEquality();
+            code.push_back(AND);
+        }
+    }
+
+    void ParseEquality()
+    {
+        ParseRelational();
+        while(!error)
+        {
+            if(Accept("==")) { ParseRelational(); code.push_back(EQ); }
+            else if(Accept("!=")) { ParseRelational(); code.push_back(NE); }
+            else break;
+        }
+    }
+
+    void ParseRelational()
+    {
+        ParseAdditive();
+        while(!error)
+        {
+            if(Accept("<=")) { ParseAdditive(); code.push_back(LE); }
+            else if(Accept(">=")) { ParseAdditive(); code.push_back(GE); }
+            else if(Accept("<")) { ParseAdditive(); code.push_back(LT); }
+            else if(Accept(">")) { ParseAdditive(); code.push_back(GT); }
+            else break;
+        }
+    }
+
+    void ParseAdditive()
+    {
+        ParseUnary();
+        while(!error)
+        {
+            if(Accept("+")) { ParseUnary(); code.push_back(ADD); }
+            else if(Accept("-")) { ParseUnary(); code.push_back(SUB); }
+            else break;
+        }
+    }
+
+    void ParseUnary()
+    {
+        if(Accept("!")) { ParseUnary(); code.push_back(NOT); }
+        else if(Accept("-")) { ParseUnary(); code.push_back(NEG); }
+        else if(Accept("~")) { ParseUnary(); code.push_back(INV); }
+        else ParsePrimary();
+    }
+
+    void ParsePrimary()
+    {
+        static const struct { const char* name; Op op; } regs[] = {
+            { "PC", REG_PC }, { "SP", REG_SP }, { "A", REG_A }, { "X", REG_X }, { "Y", REG_Y }, { "P", REG_P },
+        };
+        Skip();
+        if(Accept("("))
+        {
+            ParseOr();
+            if(!error && !Accept(")")) error = "missing )";
+            return;
+        }
+        if(Accept("["))
+        {
+            ParseOr();
+            if(!error && !Accept("]")) error = "missing ]";
+            code.push_back(LOAD);
+            return;
+        }
+        for(const auto& reg : regs)
+        {
+            if(Accept(reg.name))
+            {
+                code.push_back(reg.op);
+                return;
+            }
+        }
+        char* end;
+        long value;
+        if(*p == '$') value = strtol(p + 1, &end, 16);
+        else value = strtol(p, &end, 0);
+        if(end == p || (end == p + 1 && *p == '$'))
+        {
+            error = "expected a register, number, [address] or (expression)";
+            return;
+        }
+        if(value < INT32_MIN || value > INT32_MAX)
+        {
+            error = "number out of range";
+            return;
+        }
+        p = end;
+        code.push_back(PUSH);
+        code.push_back(value);
+    }
+};
+
+template<CpuModel Model>
 struct mos6502
 {
+	static const bool cmos = Model != NMOS_6502;
+	static const bool rockwell = Model == ROCKWELL_65C02 || Model == WDC_65C02;
+	static const bool wdc = Model == WDC_65C02;
+
 	// Registers.
 	uint8_t A; // Accumulator.
 	uint8_t X; // X-index.
@@ -65,9 +777,60 @@ struct mos6502
 		uint8_t cycles;
 	};
 
-	Instr InstrTable[256];
-
-	bool illegalOpcode;
+	// Dispatch table, built once per CPU model. Instances point at it until
+	// they patch an entry, which gives them a copy of their own. The entry
+	// after the 256 opcodes stops Run at a trap.
+	static Instr ModelTable[257];
+	const Instr* InstrTable;
+	std::shared_ptr<std::vector<Instr> > patchTable;
+
+	// Undocumented NMOS opcodes, flagged so they can be counted or rejected.
+	static bool Undocumented[256];
+
+	// Why and where the last Run stopped.
+	StopReason stopReason;
+	uint16_t stopPc;
+
+	// Set by WAI until the next interrupt and by STP until the next reset.
+	bool waiting;
+	bool stopped;
+
+	// Optional wall clock deadline, checked every deadlineBlock cycles.
+	static const uint64_t deadlineBlock = 1 << 16;
+	bool hasDeadline;
+	std::chrono::steady_clock::time_point deadline;
+
+	// Cycles added by the executing instruction on top of its table entry.
+	uint8_t extraCycles;
+
+	// Cycles executed since power on.
+	uint64_t cycleCount;
+
+	// Scheduled interrupts, fired at a cycle and optionally re-armed every
+	// period cycles. A masked IRQ keeps the line asserted until I clears.
+	static const uint64_t NEVER = UINT64_MAX;
+	uint64_t irqAt;
+	uint64_t irqPeriod;
+	uint64_t nmiAt;
+	uint64_t nmiPeriod;
+	bool irqLine;
+
+	// Cycle at which Run next stops to look at the scheduled interrupts.
+	uint64_t nextEvent;
+
+	// Cycles skipped while waiting for an interrupt.
+	uint64_t idleCycles;
+
+	// Guest clock rate for real-time waiting, or 0 to skip idle time at once.
+	double clockHz;
+	std::chrono::steady_clock::time_point clockEpoch;
+	uint64_t clockEpochCycle;
+
+	// Real-time slices run, how many finished after their deadline and the
+	// worst lateness in seconds.
+	uint64_t slices;
+	uint64_t missedDeadlines;
+	double worstLateness;
 
 	// IRQ, Reset, NMI Vectors.
 	static const uint16_t irqVectorH = 0xFFFF;
@@ -80,1460 +843,6703 @@ struct mos6502
 	// Read / Write Callbacks.
 	typedef void (*BusWrite)(uint16_t, uint8_t);
 	typedef uint8_t (*BusRead)(uint16_t);
-	BusRead Read;
-	BusWrite Write;
-
-	enum CycleMethod { INST_COUNT, CYCLE_COUNT };
+	BusRead busRead;
+	BusWrite busWrite;
+
+	// Bus page table. Pages mapped to host memory are read, written and
+	// fetched from directly. A NULL entry sends the access down the slow
+	// path, which goes through the callbacks or the traps armed on the page.
+	uint8_t* readPage[256];
+	uint8_t* writePage[256];
+	uint8_t* fetchPage[256];
+	uint8_t* ramPage[256];
+	uint8_t pageTraps[256];
+	enum { TRAP_READ = 1, TRAP_WRITE = 2, TRAP_FETCH = 4, TRAP_DIRTY = 8, TRAP_CODE = 16,
+	       TRAP_EXECUTED = 32, TRAP_WRITTEN = 64, TRAP_SHARED = 128 };
+
+	// Memory mapped by MapSparse, whose shared pages are trapped until their
+	// first write gives them a copy of their own.
+	SparseMemory* sparse;
+
+	// One bit per page set the first time it is executed from or written
+	// to, found by one-shot traps. Pages with both bits are mixed.
+	uint64_t executedPages[4];
+	uint64_t writtenPages[4];
+
+	// Pages written since the last RestoreDirtyPages, found by one-shot
+	// write traps.
+	std::vector<uint8_t> dirtyPages;
+
+	// All 64K as one host array, set while no page is trapped so that
+	// accesses skip the page table altogether.
+	uint8_t* flat;
+	uint8_t* flatMemory;
+
+	// Pseudo opcode the fetch slow path returns to stop at a trap.
+	static const uint16_t TRAP_OPCODE = 256;
+	StopReason trapReason;
+	int32_t ignoreTrapAt;
+
+	// Address of the instruction being executed.
+	uint16_t opPc;
+
+	// PC breakpoints, each with an optional condition and a hit count.
+	struct Breakpoint
+	{
+		uint16_t addr;
+		Condition condition;
+		uint64_t hits;
+	};
+	std::vector<Breakpoint> breakpoints;
+
+	// Memory watchpoints on an inclusive address range.
+	enum { WATCH_READ = 1, WATCH_WRITE = 2, WATCH_CHANGE = 4 };
+	struct Watchpoint
+	{
+		uint16_t first;
+		uint16_t last;
+		uint8_t kind;
+		bool stop;
+	};
+	struct WatchHit
+	{
+		uint8_t kind;
+		uint16_t addr;
+		uint16_t pc;
+		uint8_t oldValue;
+		uint8_t newValue;
+		uint64_t cycle;
+	};
+	std::vector<Watchpoint> watchpoints;
+
+	// The first maxWatchHits hits and how many there were in all.
+	static const size_t maxWatchHits = 1000;
+	std::vector<WatchHit> watchHits;
+	uint64_t watchHitCount;
+
+	// Timer device: writing TIMER_LATCH latches cycleCount into the eight
+	// bytes from TIMER_LATCH, little endian, and writing N to TIMER_BEGIN or
+	// TIMER_END opens or closes timing region N. Cycles are counted at the
+	// start of the accessing instruction.
+	enum { TIMER_LATCH = 0, TIMER_BEGIN = 8, TIMER_END = 9, TIMER_SIZE = 10 };
+	struct Region
+	{
+		uint64_t count;
+		uint64_t total;
+		uint64_t min;
+		uint64_t max;
+		uint64_t begin;
+		bool open;
+	};
+	int32_t timerBase;
+	uint64_t timerLatch;
+	Region regions[256];
+
+	// Sanitizer: one bit per byte set once it has been written, and a shadow
+	// of the return addresses JSR pushed with the stack pointer after each.
+	enum { SAN_UNINIT, SAN_RETURN, SAN_STACK_OVERFLOW, SAN_STACK_UNDERFLOW };
+	struct SanitizerReport
+	{
+		uint8_t kind;
+		uint16_t pc;
+		uint16_t addr;
+		uint16_t expected;
+		uint64_t cycle;
+	};
+	struct ShadowFrame
+	{
+		uint16_t ret;
+		uint8_t sp;
+	};
+	bool sanitize;
+	std::vector<uint8_t> initialized;
+	std::vector<ShadowFrame> shadowStack;
+	static const size_t maxSanitizerReports = 1000;
+	std::vector<SanitizerReport> sanitizerReports;
+	uint64_t sanitizerReportCount;
+
+	// Exit conditions besides RTS from main, which is a table patch.
+	std::vector<uint16_t> exitPcs;
+	std::vector<uint16_t> exitWrites;
+	bool exitOnLoop;
+	int exitValue;
+
+	enum CycleMethod { INST_COUNT, CYCLE_COUNT };
 
     mos6502(BusRead r, BusWrite w)
     {
-        Write = (BusWrite)w;
-        Read = (BusRead)r;
-        Instr instr;
-
-        // Fill jump table with ILLEGALs.
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_ILLEGAL;
+        busWrite = (BusWrite)w;
+        busRead = (BusRead)r;
         for(int i = 0; i < 256; i++)
         {
-            InstrTable[i] = instr;
+            ramPage[i] = NULL;
+            pageTraps[i] = 0;
+            RemapPage(i);
         }
+        flat = NULL;
+        flatMemory = NULL;
+        sparse = NULL;
+        memset(executedPages, 0, sizeof(executedPages));
+        memset(writtenPages, 0, sizeof(writtenPages));
+        ignoreTrapAt = -1;
+        watchHitCount = 0;
+        sanitize = false;
+        sanitizerReportCount = 0;
+        timerBase = -1;
+        timerLatch = 0;
+        memset(regions, 0, sizeof(regions));
+        exitOnLoop = false;
+        exitValue = -1;
+        cycleCount = 0;
+        irqAt = NEVER;
+        irqPeriod = 0;
+        nmiAt = NEVER;
+        nmiPeriod = 0;
+        irqLine = false;
+        idleCycles = 0;
+        clockHz = 0;
+        hasDeadline = false;
+        slices = 0;
+        missedDeadlines = 0;
+        worstLateness = 0;
+        static const bool built = BuildTable();
+        (void) built;
+        InstrTable = ModelTable;
+    }
 
-        // Insert opcodes.
-
-        instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 2;
-        InstrTable[0x69] = instr;
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 4;
-        InstrTable[0x6D] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 3;
-        InstrTable[0x65] = instr;
-        instr.addr = &mos6502::Addr_INX;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 6;
-        InstrTable[0x61] = instr;
-        instr.addr = &mos6502::Addr_INY;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 6;
-        InstrTable[0x71] = instr;
-        instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 4;
-        InstrTable[0x75] = instr;
-        instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 4;
-        InstrTable[0x7D] = instr;
-        instr.addr = &mos6502::Addr_ABY;
-        instr.code = &mos6502::Op_ADC;
-        instr.cycles = 4;
-        InstrTable[0x79] = instr;
+    Instr* PatchTable()
+    {
+        if(!patchTable || patchTable.use_count() > 1)
+        {
+            patchTable = std::make_shared<std::vector<Instr> >(InstrTable, InstrTable + 257);
+            InstrTable = patchTable->data();
+        }
+        return patchTable->data();
+    }
 
-        instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 2;
-        InstrTable[0x29] = instr;
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 4;
-        InstrTable[0x2D] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 3;
-        InstrTable[0x25] = instr;
-        instr.addr = &mos6502::Addr_INX;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 6;
-        InstrTable[0x21] = instr;
-        instr.addr = &mos6502::Addr_INY;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 5;
-        InstrTable[0x31] = instr;
-        instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 4;
-        InstrTable[0x35] = instr;
-        instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 4;
-        InstrTable[0x3D] = instr;
-        instr.addr = &mos6502::Addr_ABY;
-        instr.code = &mos6502::Op_AND;
-        instr.cycles = 4;
-        InstrTable[0x39] = instr;
+    void Save(CpuState& state) const
+    {
+        state.cycleCount = cycleCount;
+        state.pc = pc;
+        state.A = A;
+        state.X = X;
+        state.Y = Y;
+        state.sp = sp;
+        state.status = status;
+        state.flags = (waiting ? CpuState::STATE_WAITING : 0) | (stopped ? CpuState::STATE_STOPPED : 0)
+            | (irqLine ? CpuState::STATE_IRQ : 0) | stopReason << CpuState::STATE_BITS;
+    }
 
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_ASL;
-        instr.cycles = 6;
-        InstrTable[0x0E] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_ASL;
-        instr.cycles = 5;
-        InstrTable[0x06] = instr;
-        instr.addr = &mos6502::Addr_ACC;
-        instr.code = &mos6502::Op_ASL_ACC;
-        instr.cycles = 2;
-        InstrTable[0x0A] = instr;
-        instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_ASL;
-        instr.cycles = 6;
-        InstrTable[0x16] = instr;
-        instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_ASL;
-        instr.cycles = 7;
-        InstrTable[0x1E] = instr;
+    // Switches to another machine's state. Its memory is mapped separately.
+    void Load(const CpuState& state)
+    {
+        cycleCount = state.cycleCount;
+        pc = state.pc;
+        A = state.A;
+        X = state.X;
+        Y = state.Y;
+        sp = state.sp;
+        status = state.status;
+        waiting = state.flags & CpuState::STATE_WAITING;
+        stopped = state.flags & CpuState::STATE_STOPPED;
+        irqLine = state.flags & CpuState::STATE_IRQ;
+        stopReason = state.Reason();
+        extraCycles = 0;
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BCC;
-        instr.cycles = 2;
-        InstrTable[0x90] = instr;
+    // Save-state file: this header, then the RAM pages flagged in present
+    // in ascending order, 256 bytes each. RAM pages left out are all zeros.
+    // Breakpoints, watchpoints and sanitizer state are not saved.
+    static const uint32_t saveStateVersion = 1;
+    struct SaveStateHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t model;
+        CpuState cpu;
+        uint64_t irqAt;
+        uint64_t irqPeriod;
+        uint64_t nmiAt;
+        uint64_t nmiPeriod;
+        uint64_t idleCycles;
+        uint64_t timerLatch;
+        int32_t timerBase;
+        uint32_t headerSize;
+        uint64_t present[4];
+        Region regions[256];
+    };
+
+    // Writes the state to path with a single write. Returns an error or NULL.
+    const char* SaveState(const char* path)
+    {
+        std::vector<uint8_t> file(sizeof(SaveStateHeader));
+        SaveStateHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "RUN6502S", 8);
+        header.version = saveStateVersion;
+        header.model = Model;
+        header.headerSize = sizeof(header);
+        Save(header.cpu);
+        header.irqAt = irqAt;
+        header.irqPeriod = irqPeriod;
+        header.nmiAt = nmiAt;
+        header.nmiPeriod = nmiPeriod;
+        header.idleCycles = idleCycles;
+        header.timerLatch = timerLatch;
+        header.timerBase = timerBase;
+        memcpy(header.regions, regions, sizeof(regions));
+        for(int page = 0; page < 256; page++)
+        {
+            const uint8_t* ram = ramPage[page];
+            if(ram && (ram[0] != 0 || memcmp(ram, ram + 1, 255) != 0))
+            {
+                header.present[page >> 6] |= 1ull << (page & 63);
+                file.insert(file.end(), ram, ram + 256);
+            }
+        }
+        memcpy(file.data(), &header, sizeof(header));
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+        {
+            return "could not create the file";
+        }
+        bool written = write(fd, file.data(), file.size()) == (ssize_t) file.size();
+        if(close(fd) != 0 || !written)
+        {
+            return "could not write the file";
+        }
+        return NULL;
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BCS;
-        instr.cycles = 2;
-        InstrTable[0xB0] = instr;
+    // Maps a save-state file and takes its registers, devices and RAM pages
+    // over. Returns an error or NULL.
+    const char* LoadState(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0)
+        {
+            return "could not open the file";
+        }
+        struct stat st;
+        void* map = fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(SaveStateHeader)
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(map == MAP_FAILED)
+        {
+            return "not a save-state file";
+        }
+        const SaveStateHeader& header = *(const SaveStateHeader*) map;
+        const uint8_t* pages = (const uint8_t*) map + sizeof(SaveStateHeader);
+        size_t count = 0;
+        for(uint64_t bits : header.present)
+        {
+            count += __builtin_popcountll(bits);
+        }
+        const char* error = NULL;
+        if(memcmp(header.magic, "RUN6502S", 8) != 0 || header.headerSize != sizeof(SaveStateHeader))
+        {
+            error = "not a save-state file of this version";
+        }
+        else if(header.version != saveStateVersion)
+        {
+            error = "save-state version not supported";
+        }
+        else if(header.model != Model)
+        {
+            error = "save-state was made with another CPU model";
+        }
+        else if((size_t) st.st_size != sizeof(SaveStateHeader) + count * 256)
+        {
+            error = "save-state file is truncated";
+        }
+        else
+        {
+            Load(header.cpu);
+            irqAt = header.irqAt;
+            irqPeriod = header.irqPeriod;
+            nmiAt = header.nmiAt;
+            nmiPeriod = header.nmiPeriod;
+            idleCycles = header.idleCycles;
+            timerLatch = header.timerLatch;
+            memcpy(regions, header.regions, sizeof(regions));
+            if(header.timerBase >= 0 && header.timerBase != timerBase)
+            {
+                MapTimer(header.timerBase);
+            }
+            for(int page = 0; page < 256; page++)
+            {
+                uint8_t* ram = ramPage[page];
+                if(ram && (pageTraps[page] & TRAP_SHARED))
+                {
+                    ram = ramPage[page] = sparse->Own(page);
+                    DisarmTrap(page << 8, TRAP_SHARED);
+                    if(ram == NULL)
+                    {
+                        error = "no memory left for the save-state pages";
+                        break;
+                    }
+                }
+                if(header.present[page >> 6] >> (page & 63) & 1)
+                {
+                    if(ram)
+                    {
+                        memcpy(ram, pages, 256);
+                    }
+                    pages += 256;
+                }
+                else if(ram)
+                {
+                    memset(ram, 0, 256);
+                }
+            }
+        }
+        munmap(map, st.st_size);
+        return error;
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BEQ;
-        instr.cycles = 2;
-        InstrTable[0xF0] = instr;
+    // Maps pages of host memory, so that they skip the callbacks.
+    void MapRam(uint8_t* memory, int first = 0, int count = 256)
+    {
+        for(int i = first; i < first + count; i++)
+        {
+            ramPage[i] = memory + (i - first) * 256;
+            pageTraps[i] &= ~TRAP_SHARED;
+            RemapPage(i);
+        }
+        flatMemory = first == 0 && count == 256 ? memory : NULL;
+        UpdateFlat();
+    }
 
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_BIT;
-        instr.cycles = 4;
-        InstrTable[0x2C] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_BIT;
-        instr.cycles = 3;
-        InstrTable[0x24] = instr;
+    // Maps all 64K from sparse memory, trapping writes to its shared pages.
+    void MapSparse(SparseMemory* memory)
+    {
+        sparse = memory;
+        for(int i = 0, rank = 0; i < 256; i++)
+        {
+            ramPage[i] = memory->Owned(i) ? memory->owned[rank++] : memory->image->pages[i];
+            pageTraps[i] = (pageTraps[i] & ~TRAP_SHARED) | (memory->Owned(i) ? 0 : TRAP_SHARED);
+            RemapPage(i);
+        }
+        flatMemory = NULL;
+        UpdateFlat();
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BMI;
-        instr.cycles = 2;
-        InstrTable[0x30] = instr;
+    void RemapPage(int page)
+    {
+        uint8_t* ram = ramPage[page];
+        readPage[page] = pageTraps[page] & TRAP_READ ? NULL : ram;
+        writePage[page] = pageTraps[page] & (TRAP_WRITE | TRAP_DIRTY | TRAP_CODE | TRAP_WRITTEN | TRAP_SHARED) ? NULL : ram;
+        fetchPage[page] = pageTraps[page] & (TRAP_FETCH | TRAP_EXECUTED) ? NULL : ram;
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BNE;
-        instr.cycles = 2;
-        InstrTable[0xD0] = instr;
+    void ArmTrap(uint16_t addr, uint8_t trap)
+    {
+        pageTraps[addr >> 8] |= trap;
+        RemapPage(addr >> 8);
+        UpdateFlat();
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BPL;
-        instr.cycles = 2;
-        InstrTable[0x10] = instr;
+    void DisarmTrap(uint16_t addr, uint8_t trap)
+    {
+        pageTraps[addr >> 8] &= ~trap;
+        RemapPage(addr >> 8);
+        UpdateFlat();
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_BRK;
-        instr.cycles = 7;
-        InstrTable[0x00] = instr;
+    void UpdateFlat()
+    {
+        flat = flatMemory;
+        for(int i = 0; i < 256; i++)
+        {
+            if(pageTraps[i])
+            {
+                flat = NULL;
+            }
+        }
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BVC;
-        instr.cycles = 2;
-        InstrTable[0x50] = instr;
+    // Reads memory without tripping any trap.
+    uint8_t Peek(uint16_t addr)
+    {
+        uint8_t* ram = ramPage[addr >> 8];
+        return ram ? ram[addr & 0xFF] : busRead(addr);
+    }
 
-        instr.addr = &mos6502::Addr_REL;
-        instr.code = &mos6502::Op_BVS;
-        instr.cycles = 2;
-        InstrTable[0x70] = instr;
+    uint8_t Read(uint16_t addr)
+    {
+        if(flat)
+        {
+            return flat[addr];
+        }
+        uint8_t* page = readPage[addr >> 8];
+        if(page)
+        {
+            return page[addr & 0xFF];
+        }
+        return ReadSlow(addr);
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_CLC;
-        instr.cycles = 2;
-        InstrTable[0x18] = instr;
+    void Write(uint16_t addr, uint8_t data)
+    {
+        if(flat)
+        {
+            flat[addr] = data;
+            return;
+        }
+        uint8_t* page = writePage[addr >> 8];
+        if(page)
+        {
+            page[addr & 0xFF] = data;
+            return;
+        }
+        WriteSlow(addr, data);
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_CLD;
-        instr.cycles = 2;
-        InstrTable[0xD8] = instr;
+    // Opcode fetch. Returns TRAP_OPCODE instead when a trap fires.
+    uint16_t Fetch(uint16_t addr)
+    {
+        if(flat)
+        {
+            return flat[addr];
+        }
+        uint8_t* page = fetchPage[addr >> 8];
+        if(page)
+        {
+            return page[addr & 0xFF];
+        }
+        return FetchSlow(addr);
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_CLI;
-        instr.cycles = 2;
-        InstrTable[0x58] = instr;
+    uint8_t ReadSlow(uint16_t addr)
+    {
+        if(timerBase >= 0 && addr >= timerBase && addr < timerBase + TIMER_SIZE)
+        {
+            int reg = addr - timerBase;
+            return reg < TIMER_BEGIN ? timerLatch >> (8 * reg) : 0;
+        }
+        uint8_t data = Peek(addr);
+        if(pageTraps[addr >> 8] & TRAP_READ)
+        {
+            // Each uninitialized byte is reported once, then counts as initialized.
+            uint8_t bit = 1 << (addr & 7);
+            if(sanitize && ramPage[addr >> 8] && !(initialized[addr >> 3] & bit))
+            {
+                initialized[addr >> 3] |= bit;
+                Report(SAN_UNINIT, addr);
+            }
+            CheckWatchpoints(WATCH_READ, addr, data, data);
+        }
+        return data;
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_CLV;
-        instr.cycles = 2;
-        InstrTable[0xB8] = instr;
+    void WriteSlow(uint16_t addr, uint8_t data)
+    {
+        // The page is owned before anything else looks at it, devices too.
+        if(pageTraps[addr >> 8] & TRAP_SHARED)
+        {
+            uint8_t* page = sparse->Own(addr >> 8);
+            if(page == NULL)
+            {
+                Stop(STOP_MEMORY, opPc);
+                return;
+            }
+            ramPage[addr >> 8] = page;
+            DisarmTrap(addr, TRAP_SHARED);
+        }
+        if(timerBase >= 0 && addr >= timerBase && addr < timerBase + TIMER_SIZE)
+        {
+            TimerWrite(addr - timerBase, data);
+            return;
+        }
+        if(pageTraps[addr >> 8] & TRAP_DIRTY)
+        {
+            dirtyPages.push_back(addr >> 8);
+            DisarmTrap(addr, TRAP_DIRTY);
+        }
+        if(pageTraps[addr >> 8] & TRAP_WRITTEN)
+        {
+            writtenPages[addr >> 14] |= 1ull << (addr >> 8 & 63);
+            DisarmTrap(addr, TRAP_WRITTEN);
+        }
+        // Recompiled code on the page may be stale from here on.
+        if(pageTraps[addr >> 8] & TRAP_CODE)
+        {
+            DisarmTrap(addr, TRAP_CODE);
+        }
+        uint8_t* ram = ramPage[addr >> 8];
+        uint8_t old = 0;
+        if(pageTraps[addr >> 8] & TRAP_WRITE)
+        {
+            old = Peek(addr);
+        }
+        if(ram)
+        {
+            ram[addr & 0xFF] = data;
+        }
+        else
+        {
+            busWrite(addr, data);
+        }
+        if(pageTraps[addr >> 8] & TRAP_WRITE)
+        {
+            if(sanitize)
+            {
+                initialized[addr >> 3] |= 1 << (addr & 7);
+            }
+            CheckWatchpoints(data != old ? WATCH_WRITE | WATCH_CHANGE : WATCH_WRITE, addr, old, data);
+            for(uint16_t exit : exitWrites)
+            {
+                if(addr == exit)
+                {
+                    exitValue = data;
+                    Stop(STOP_EXIT, opPc);
+                }
+            }
+        }
+    }
 
-        instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 2;
-        InstrTable[0xC9] = instr;
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 4;
-        InstrTable[0xCD] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 3;
-        InstrTable[0xC5] = instr;
-        instr.addr = &mos6502::Addr_INX;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 6;
-        InstrTable[0xC1] = instr;
-        instr.addr = &mos6502::Addr_INY;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 3;
-        InstrTable[0xD1] = instr;
-        instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 4;
-        InstrTable[0xD5] = instr;
-        instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 4;
-        InstrTable[0xDD] = instr;
-        instr.addr = &mos6502::Addr_ABY;
-        instr.code = &mos6502::Op_CMP;
-        instr.cycles = 4;
-        InstrTable[0xD9] = instr;
+    uint16_t FetchSlow(uint16_t addr)
+    {
+        if(pageTraps[addr >> 8] & TRAP_EXECUTED)
+        {
+            MarkExecuted(addr >> 8);
+        }
+        if(addr == ignoreTrapAt)
+        {
+            ignoreTrapAt = -1;
+        }
+        else if(pageTraps[addr >> 8] & TRAP_FETCH)
+        {
+            for(Breakpoint& b : breakpoints)
+            {
+                if(addr == b.addr)
+                {
+                    // Conditions see PC at the breakpoint, not past its opcode.
+                    uint16_t next = pc;
+                    pc = addr;
+                    bool hit = b.condition.Eval(*this);
+                    pc = next;
+                    b.hits++;
+                    if(hit)
+                    {
+                        trapReason = STOP_BREAKPOINT;
+                        return TRAP_OPCODE;
+                    }
+                }
+            }
+            for(uint16_t exit : exitPcs)
+            {
+                if(addr == exit)
+                {
+                    trapReason = STOP_EXIT;
+                    return TRAP_OPCODE;
+                }
+            }
+        }
+        return Peek(addr);
+    }
 
-        instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_CPX;
-        instr.cycles = 2;
-        InstrTable[0xE0] = instr;
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_CPX;
-        instr.cycles = 4;
-        InstrTable[0xEC] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_CPX;
-        instr.cycles = 3;
-        InstrTable[0xE4] = instr;
+    void CheckWatchpoints(uint8_t kind, uint16_t addr, uint8_t oldValue, uint8_t newValue)
+    {
+        for(const Watchpoint& w : watchpoints)
+        {
+            if((w.kind & kind) && addr >= w.first && addr <= w.last)
+            {
+                WatchHit hit;
+                hit.kind = w.kind & kind;
+                hit.addr = addr;
+                hit.pc = opPc;
+                hit.oldValue = oldValue;
+                hit.newValue = newValue;
+                hit.cycle = cycleCount;
+                if(watchHits.size() < maxWatchHits)
+                {
+                    watchHits.push_back(hit);
+                }
+                watchHitCount++;
+                if(w.stop)
+                {
+                    Stop(STOP_WATCHPOINT, opPc);
+                }
+            }
+        }
+    }
+
+    // Records which RAM pages get written from here on, so that they alone
+    // need copying back between runs.
+    void TrackDirtyPages()
+    {
+        dirtyPages.clear();
+        for(int page = 0; page < 256; page++)
+        {
+            if(ramPage[page])
+            {
+                ArmTrap(page << 8, TRAP_DIRTY);
+            }
+        }
+    }
+
+    // Classifies RAM pages as code, data or mixed from here on. Each page
+    // takes the slow path once per kind of access, then runs at full speed.
+    void ClassifyPages()
+    {
+        for(int page = 0; page < 256; page++)
+        {
+            if(ramPage[page])
+            {
+                ArmTrap(page << 8, (Executed(page) ? 0 : TRAP_EXECUTED) | (Written(page) ? 0 : TRAP_WRITTEN));
+            }
+        }
+    }
+
+    void MarkExecuted(uint8_t page)
+    {
+        executedPages[page >> 6] |= 1ull << (page & 63);
+        DisarmTrap(page << 8, TRAP_EXECUTED);
+    }
+
+    bool Executed(uint8_t page) const
+    {
+        return executedPages[page >> 6] >> (page & 63) & 1;
+    }
+
+    bool Written(uint8_t page) const
+    {
+        return writtenPages[page >> 6] >> (page & 63) & 1;
+    }
+
+    // Executed and written: self-modifying code or code sharing its page
+    // with data. Never run as recompiled code.
+    bool Mixed(uint8_t page) const
+    {
+        return Executed(page) && Written(page);
+    }
+
+    // Copies the dirty pages back from a 64K snapshot and tracks them again.
+    void RestoreDirtyPages(const uint8_t* snapshot)
+    {
+        for(uint8_t page : dirtyPages)
+        {
+            memcpy(ramPage[page], snapshot + page * 256, 256);
+            pageTraps[page] |= TRAP_DIRTY;
+            RemapPage(page);
+        }
+        dirtyPages.clear();
+        UpdateFlat();
+    }
+
+    // Maps the timer device at base. Its page is trapped, the rest of the
+    // page stays ordinary memory.
+    void MapTimer(uint16_t base)
+    {
+        timerBase = base;
+        for(int page = base >> 8; page <= (base + TIMER_SIZE - 1) >> 8 && page < 256; page++)
+        {
+            ArmTrap(page << 8, TRAP_READ | TRAP_WRITE);
+        }
+    }
+
+    void TimerWrite(int reg, uint8_t data)
+    {
+        Region& r = regions[data];
+        if(reg == TIMER_LATCH)
+        {
+            timerLatch = cycleCount;
+        }
+        else if(reg == TIMER_BEGIN)
+        {
+            r.begin = cycleCount;
+            r.open = true;
+        }
+        else if(reg == TIMER_END && r.open)
+        {
+            uint64_t cycles = cycleCount - r.begin;
+            r.min = r.count == 0 || cycles < r.min ? cycles : r.min;
+            r.max = cycles > r.max ? cycles : r.max;
+            r.total += cycles;
+            r.count++;
+            r.open = false;
+        }
+    }
+
+    // Checks uninitialized reads, JSR/RTS pairing and stack wrap-around.
+    // Every RAM page is trapped for reads and writes, which keeps the init
+    // bitmap off the fast path of unsanitized runs. Loaded images are marked
+    // with MarkInitialized.
+    void Sanitize()
+    {
+        sanitize = true;
+        initialized.assign(65536 / 8, 0);
+        for(int page = 0; page < 256; page++)
+        {
+            if(ramPage[page])
+            {
+                ArmTrap(page << 8, TRAP_READ | TRAP_WRITE);
+            }
+        }
+    }
+
+    void MarkInitialized(uint16_t first, size_t count)
+    {
+        for(size_t i = 0; i < count && first + i < 65536; i++)
+        {
+            initialized[(first + i) >> 3] |= 1 << ((first + i) & 7);
+        }
+    }
+
+    void Report(uint8_t kind, uint16_t addr, uint16_t expected = 0)
+    {
+        if(sanitizerReports.size() < maxSanitizerReports)
+        {
+            SanitizerReport report;
+            report.kind = kind;
+            report.pc = opPc;
+            report.addr = addr;
+            report.expected = expected;
+            report.cycle = cycleCount;
+            sanitizerReports.push_back(report);
+        }
+        sanitizerReportCount++;
+    }
+
+    // Pairs an RTS with the JSR that pushed to the same stack slot. Frames
+    // the stack pointer has already moved past were dropped by the program,
+    // and an RTS with no frame of its own is a computed jump, not a mistake.
+    void CheckReturn()
+    {
+        while(!shadowStack.empty() && shadowStack.back().sp < sp)
+        {
+            shadowStack.pop_back();
+        }
+        if(!shadowStack.empty() && shadowStack.back().sp == sp)
+        {
+            uint16_t ret = Peek(0x0100 + ((sp + 1) & 0xFF)) | (Peek(0x0100 + ((sp + 2) & 0xFF)) << 8);
+            if(ret != shadowStack.back().ret)
+            {
+                Report(SAN_RETURN, ret + 1, shadowStack.back().ret + 1);
+            }
+            shadowStack.pop_back();
+        }
+    }
+
+    // Watches reads, writes or changes of value in first to last. Pages in
+    // the range send their reads or writes down the slow path to be
+    // checked, every other page keeps accessing memory directly.
+    void AddWatchpoint(uint16_t first, uint16_t last, uint8_t kind, bool stop)
+    {
+        Watchpoint w;
+        w.first = first;
+        w.last = last;
+        w.kind = kind;
+        w.stop = stop;
+        watchpoints.push_back(w);
+        for(int page = first >> 8; page <= last >> 8; page++)
+        {
+            if(kind & WATCH_READ)
+            {
+                ArmTrap(page << 8, TRAP_READ);
+            }
+            if(kind & (WATCH_WRITE | WATCH_CHANGE))
+            {
+                ArmTrap(page << 8, TRAP_WRITE);
+            }
+        }
+    }
+
+    // Exit conditions.
+
+    // RTS with the stack empty, the end of main.
+    void ExitOnRts()
+    {
+        PatchTable()[0x60].code = &mos6502::Op_RTS_EXIT;
+    }
+
+    void ExitOnBrk()
+    {
+        PatchTable()[0x00].code = &mos6502::Op_BRK_EXIT;
+    }
+
+    // Jumps or branches to themselves, unless an interrupt is on its way.
+    void ExitOnLoop()
+    {
+        exitOnLoop = true;
+    }
+
+    void ExitAtPc(uint16_t addr)
+    {
+        exitPcs.push_back(addr);
+        ArmTrap(addr, TRAP_FETCH);
+    }
+
+    // Any write to addr, keeping the value written in exitValue.
+    void ExitOnWrite(uint16_t addr)
+    {
+        exitWrites.push_back(addr);
+        ArmTrap(addr, TRAP_WRITE);
+    }
+
+    // Breakpoints. Only the page holding addr pays for the check, and only on
+    // opcode fetches; the fetch returns the trap opcode when the breakpoint
+    // is hit and its condition, compiled once here, holds. Returns NULL, or
+    // what is wrong with the condition.
+    const char* AddBreakpoint(uint16_t addr, const char* condition = "")
+    {
+        Breakpoint b;
+        b.addr = addr;
+        b.hits = 0;
+        if(!b.condition.Compile(condition))
+        {
+            return b.condition.error;
+        }
+        breakpoints.push_back(b);
+        ArmTrap(addr, TRAP_FETCH);
+        return NULL;
+    }
+
+    void RemoveBreakpoint(uint16_t addr)
+    {
+        bool trapped = false;
+        for(size_t i = 0; i < breakpoints.size(); i++)
+        {
+            if(breakpoints[i].addr == addr)
+            {
+                breakpoints.erase(breakpoints.begin() + i--);
+            }
+            else if(breakpoints[i].addr >> 8 == addr >> 8)
+            {
+                trapped = true;
+            }
+        }
+        for(uint16_t exit : exitPcs)
+        {
+            if(exit >> 8 == addr >> 8)
+            {
+                trapped = true;
+            }
+        }
+        if(!trapped)
+        {
+            DisarmTrap(addr, TRAP_FETCH);
+        }
+    }
+
+    // Routes every undocumented opcode to Op_ILLEGAL.
+    void RejectUndocumented()
+    {
+        Instr* table = PatchTable();
+        for(int i = 0; i < 256; i++)
+        {
+            if(Undocumented[i])
+            {
+                table[i].addr = &mos6502::Addr_IMP;
+                table[i].code = &mos6502::Op_ILLEGAL;
+            }
+        }
+    }
+
+    // Bytes taken by an instruction, opcode included.
+    int InstrLength(uint8_t opcode) const
+    {
+        AddrExec a = InstrTable[opcode].addr;
+        if(rockwell && (opcode & 0x0F) == 0x0F)
+        {
+            return 3;
+        }
+        if(a == &mos6502::Addr_IMP || a == &mos6502::Addr_ACC)
+        {
+            return 1;
+        }
+        if(a == &mos6502::Addr_ABS || a == &mos6502::Addr_ABX || a == &mos6502::Addr_ABY || a == &mos6502::Addr_ABX_P
+            || a == &mos6502::Addr_ABY_P || a == &mos6502::Addr_ABI || a == &mos6502::Addr_AIX)
+        {
+            return 3;
+        }
+        return 2;
+    }
+
+    // Moves the indexed reads over to the addressing modes that charge for
+    // page crossings. They are the entries at the base cycle count, and on
+    // CMOS the shifts and rotates by abs,X, which skip the cycle otherwise.
+    static void BuildPageCrossTable()
+    {
+        for(int i = 0; i < 256; i++)
+        {
+            Instr& instr = ModelTable[i];
+            if(instr.addr == &mos6502::Addr_ABX && (instr.cycles == 4 || (cmos && (i & 0x9F) == 0x1E)))
+            {
+                instr.addr = &mos6502::Addr_ABX_P;
+            }
+            else if(instr.addr == &mos6502::Addr_ABY && instr.cycles == 4)
+            {
+                instr.addr = &mos6502::Addr_ABY_P;
+            }
+            else if(instr.addr == &mos6502::Addr_INY && instr.cycles == 5)
+            {
+                instr.addr = &mos6502::Addr_INY_P;
+            }
+        }
+    }
+
+    static bool BuildTable()
+    {
+        Instr instr;
+
+        // Fill jump table with ILLEGALs.
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_ILLEGAL;
+        instr.cycles = 0;
+        for(int i = 0; i < 256; i++)
+        {
+            ModelTable[i] = instr;
+        }
+
+        // The CMOS parts have no illegal opcodes, only NOPs of varying length.
+        if(cmos)
+        {
+            instr.code = &mos6502::Op_NOP;
+            for(int i = 0; i < 256; i++)
+            {
+                instr.addr = &mos6502::Addr_IMP;
+                instr.cycles = 1;
+                if((i & 0x0F) == 0x02)
+                {
+                    instr.addr = &mos6502::Addr_IMM;
+                    instr.cycles = 2;
+                }
+                ModelTable[i] = instr;
+            }
+            instr.addr = &mos6502::Addr_IMM;
+            instr.cycles = 3;
+            ModelTable[0x44] = instr;
+            instr.cycles = 4;
+            ModelTable[0x54] = instr;
+            ModelTable[0xD4] = instr;
+            ModelTable[0xF4] = instr;
+            instr.addr = &mos6502::Addr_ABS;
+            instr.cycles = 8;
+            ModelTable[0x5C] = instr;
+            instr.cycles = 4;
+            ModelTable[0xDC] = instr;
+            ModelTable[0xFC] = instr;
+        }
+
+        // Insert opcodes.
 
         instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_CPY;
+        instr.code = &mos6502::Op_ADC;
         instr.cycles = 2;
-        InstrTable[0xC0] = instr;
+        ModelTable[0x69] = instr;
         instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_CPY;
+        instr.code = &mos6502::Op_ADC;
         instr.cycles = 4;
-        InstrTable[0xCC] = instr;
+        ModelTable[0x6D] = instr;
         instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_CPY;
+        instr.code = &mos6502::Op_ADC;
         instr.cycles = 3;
-        InstrTable[0xC4] = instr;
-
-        instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_DEC;
+        ModelTable[0x65] = instr;
+        instr.addr = &mos6502::Addr_INX;
+        instr.code = &mos6502::Op_ADC;
         instr.cycles = 6;
-        InstrTable[0xCE] = instr;
-        instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_DEC;
+        ModelTable[0x61] = instr;
+        instr.addr = &mos6502::Addr_INY;
+        instr.code = &mos6502::Op_ADC;
         instr.cycles = 5;
-        InstrTable[0xC6] = instr;
+        ModelTable[0x71] = instr;
         instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_DEC;
-        instr.cycles = 6;
-        InstrTable[0xD6] = instr;
+        instr.code = &mos6502::Op_ADC;
+        instr.cycles = 4;
+        ModelTable[0x75] = instr;
         instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_DEC;
-        instr.cycles = 7;
-        InstrTable[0xDE] = instr;
-
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_DEX;
-        instr.cycles = 2;
-        InstrTable[0xCA] = instr;
-
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_DEY;
-        instr.cycles = 2;
-        InstrTable[0x88] = instr;
+        instr.code = &mos6502::Op_ADC;
+        instr.cycles = 4;
+        ModelTable[0x7D] = instr;
+        instr.addr = &mos6502::Addr_ABY;
+        instr.code = &mos6502::Op_ADC;
+        instr.cycles = 4;
+        ModelTable[0x79] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 2;
-        InstrTable[0x49] = instr;
+        ModelTable[0x29] = instr;
         instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 4;
-        InstrTable[0x4D] = instr;
+        ModelTable[0x2D] = instr;
         instr.addr = &mos6502::Addr_ZER;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 3;
-        InstrTable[0x45] = instr;
+        ModelTable[0x25] = instr;
         instr.addr = &mos6502::Addr_INX;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 6;
-        InstrTable[0x41] = instr;
+        ModelTable[0x21] = instr;
         instr.addr = &mos6502::Addr_INY;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 5;
-        InstrTable[0x51] = instr;
+        ModelTable[0x31] = instr;
         instr.addr = &mos6502::Addr_ZEX;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 4;
-        InstrTable[0x55] = instr;
+        ModelTable[0x35] = instr;
         instr.addr = &mos6502::Addr_ABX;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 4;
-        InstrTable[0x5D] = instr;
+        ModelTable[0x3D] = instr;
         instr.addr = &mos6502::Addr_ABY;
-        instr.code = &mos6502::Op_EOR;
+        instr.code = &mos6502::Op_AND;
         instr.cycles = 4;
-        InstrTable[0x59] = instr;
+        ModelTable[0x39] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
-        instr.code = &mos6502::Op_INC;
+        instr.code = &mos6502::Op_ASL;
         instr.cycles = 6;
-        InstrTable[0xEE] = instr;
+        ModelTable[0x0E] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_ASL;
+        instr.cycles = 5;
+        ModelTable[0x06] = instr;
+        instr.addr = &mos6502::Addr_ACC;
+        instr.code = &mos6502::Op_ASL_ACC;
+        instr.cycles = 2;
+        ModelTable[0x0A] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_ASL;
+        instr.cycles = 6;
+        ModelTable[0x16] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_ASL;
+        instr.cycles = 7;
+        ModelTable[0x1E] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BCC;
+        instr.cycles = 2;
+        ModelTable[0x90] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BCS;
+        instr.cycles = 2;
+        ModelTable[0xB0] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BEQ;
+        instr.cycles = 2;
+        ModelTable[0xF0] = instr;
+
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_BIT;
+        instr.cycles = 4;
+        ModelTable[0x2C] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_BIT;
+        instr.cycles = 3;
+        ModelTable[0x24] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BMI;
+        instr.cycles = 2;
+        ModelTable[0x30] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BNE;
+        instr.cycles = 2;
+        ModelTable[0xD0] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BPL;
+        instr.cycles = 2;
+        ModelTable[0x10] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_BRK;
+        instr.cycles = 7;
+        ModelTable[0x00] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BVC;
+        instr.cycles = 2;
+        ModelTable[0x50] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BVS;
+        instr.cycles = 2;
+        ModelTable[0x70] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_CLC;
+        instr.cycles = 2;
+        ModelTable[0x18] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_CLD;
+        instr.cycles = 2;
+        ModelTable[0xD8] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_CLI;
+        instr.cycles = 2;
+        ModelTable[0x58] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_CLV;
+        instr.cycles = 2;
+        ModelTable[0xB8] = instr;
+
+        instr.addr = &mos6502::Addr_IMM;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 2;
+        ModelTable[0xC9] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 4;
+        ModelTable[0xCD] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 3;
+        ModelTable[0xC5] = instr;
+        instr.addr = &mos6502::Addr_INX;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 6;
+        ModelTable[0xC1] = instr;
+        instr.addr = &mos6502::Addr_INY;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 5;
+        ModelTable[0xD1] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 4;
+        ModelTable[0xD5] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 4;
+        ModelTable[0xDD] = instr;
+        instr.addr = &mos6502::Addr_ABY;
+        instr.code = &mos6502::Op_CMP;
+        instr.cycles = 4;
+        ModelTable[0xD9] = instr;
+
+        instr.addr = &mos6502::Addr_IMM;
+        instr.code = &mos6502::Op_CPX;
+        instr.cycles = 2;
+        ModelTable[0xE0] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_CPX;
+        instr.cycles = 4;
+        ModelTable[0xEC] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_CPX;
+        instr.cycles = 3;
+        ModelTable[0xE4] = instr;
+
+        instr.addr = &mos6502::Addr_IMM;
+        instr.code = &mos6502::Op_CPY;
+        instr.cycles = 2;
+        ModelTable[0xC0] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_CPY;
+        instr.cycles = 4;
+        ModelTable[0xCC] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_CPY;
+        instr.cycles = 3;
+        ModelTable[0xC4] = instr;
+
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_DEC;
+        instr.cycles = 6;
+        ModelTable[0xCE] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_DEC;
+        instr.cycles = 5;
+        ModelTable[0xC6] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_DEC;
+        instr.cycles = 6;
+        ModelTable[0xD6] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_DEC;
+        instr.cycles = 7;
+        ModelTable[0xDE] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_DEX;
+        instr.cycles = 2;
+        ModelTable[0xCA] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_DEY;
+        instr.cycles = 2;
+        ModelTable[0x88] = instr;
+
+        instr.addr = &mos6502::Addr_IMM;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 2;
+        ModelTable[0x49] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 4;
+        ModelTable[0x4D] = instr;
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 3;
+        ModelTable[0x45] = instr;
+        instr.addr = &mos6502::Addr_INX;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 6;
+        ModelTable[0x41] = instr;
+        instr.addr = &mos6502::Addr_INY;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 5;
+        ModelTable[0x51] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 4;
+        ModelTable[0x55] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 4;
+        ModelTable[0x5D] = instr;
+        instr.addr = &mos6502::Addr_ABY;
+        instr.code = &mos6502::Op_EOR;
+        instr.cycles = 4;
+        ModelTable[0x59] = instr;
+
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_INC;
+        instr.cycles = 6;
+        ModelTable[0xEE] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_INC;
         instr.cycles = 5;
-        InstrTable[0xE6] = instr;
+        ModelTable[0xE6] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_INC;
         instr.cycles = 6;
-        InstrTable[0xF6] = instr;
+        ModelTable[0xF6] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_INC;
         instr.cycles = 7;
-        InstrTable[0xFE] = instr;
+        ModelTable[0xFE] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_INX;
         instr.cycles = 2;
-        InstrTable[0xE8] = instr;
+        ModelTable[0xE8] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_INY;
         instr.cycles = 2;
-        InstrTable[0xC8] = instr;
+        ModelTable[0xC8] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_JMP;
         instr.cycles = 3;
-        InstrTable[0x4C] = instr;
+        ModelTable[0x4C] = instr;
         instr.addr = &mos6502::Addr_ABI;
         instr.code = &mos6502::Op_JMP;
         instr.cycles = 5;
-        InstrTable[0x6C] = instr;
+        ModelTable[0x6C] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_JSR;
         instr.cycles = 6;
-        InstrTable[0x20] = instr;
+        ModelTable[0x20] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 2;
-        InstrTable[0xA9] = instr;
+        ModelTable[0xA9] = instr;
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 4;
-        InstrTable[0xAD] = instr;
+        ModelTable[0xAD] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 3;
-        InstrTable[0xA5] = instr;
+        ModelTable[0xA5] = instr;
         instr.addr = &mos6502::Addr_INX;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 6;
-        InstrTable[0xA1] = instr;
+        ModelTable[0xA1] = instr;
         instr.addr = &mos6502::Addr_INY;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 5;
-        InstrTable[0xB1] = instr;
+        ModelTable[0xB1] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 4;
-        InstrTable[0xB5] = instr;
+        ModelTable[0xB5] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 4;
-        InstrTable[0xBD] = instr;
+        ModelTable[0xBD] = instr;
         instr.addr = &mos6502::Addr_ABY;
         instr.code = &mos6502::Op_LDA;
         instr.cycles = 4;
-        InstrTable[0xB9] = instr;
+        ModelTable[0xB9] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
         instr.code = &mos6502::Op_LDX;
         instr.cycles = 2;
-        InstrTable[0xA2] = instr;
+        ModelTable[0xA2] = instr;
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_LDX;
         instr.cycles = 4;
-        InstrTable[0xAE] = instr;
+        ModelTable[0xAE] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_LDX;
         instr.cycles = 3;
-        InstrTable[0xA6] = instr;
+        ModelTable[0xA6] = instr;
         instr.addr = &mos6502::Addr_ABY;
         instr.code = &mos6502::Op_LDX;
         instr.cycles = 4;
-        InstrTable[0xBE] = instr;
+        ModelTable[0xBE] = instr;
         instr.addr = &mos6502::Addr_ZEY;
         instr.code = &mos6502::Op_LDX;
         instr.cycles = 4;
-        InstrTable[0xB6] = instr;
+        ModelTable[0xB6] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
         instr.code = &mos6502::Op_LDY;
         instr.cycles = 2;
-        InstrTable[0xA0] = instr;
+        ModelTable[0xA0] = instr;
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_LDY;
         instr.cycles = 4;
-        InstrTable[0xAC] = instr;
+        ModelTable[0xAC] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_LDY;
         instr.cycles = 3;
-        InstrTable[0xA4] = instr;
+        ModelTable[0xA4] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_LDY;
         instr.cycles = 4;
-        InstrTable[0xB4] = instr;
+        ModelTable[0xB4] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_LDY;
         instr.cycles = 4;
-        InstrTable[0xBC] = instr;
+        ModelTable[0xBC] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_LSR;
         instr.cycles = 6;
-        InstrTable[0x4E] = instr;
+        ModelTable[0x4E] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_LSR;
         instr.cycles = 5;
-        InstrTable[0x46] = instr;
+        ModelTable[0x46] = instr;
         instr.addr = &mos6502::Addr_ACC;
         instr.code = &mos6502::Op_LSR_ACC;
         instr.cycles = 2;
-        InstrTable[0x4A] = instr;
+        ModelTable[0x4A] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_LSR;
         instr.cycles = 6;
-        InstrTable[0x56] = instr;
+        ModelTable[0x56] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_LSR;
         instr.cycles = 7;
-        InstrTable[0x5E] = instr;
+        ModelTable[0x5E] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_NOP;
         instr.cycles = 2;
-        InstrTable[0xEA] = instr;
+        ModelTable[0xEA] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 2;
-        InstrTable[0x09] = instr;
+        ModelTable[0x09] = instr;
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 4;
-        InstrTable[0x0D] = instr;
+        ModelTable[0x0D] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 3;
-        InstrTable[0x05] = instr;
+        ModelTable[0x05] = instr;
         instr.addr = &mos6502::Addr_INX;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 6;
-        InstrTable[0x01] = instr;
+        ModelTable[0x01] = instr;
         instr.addr = &mos6502::Addr_INY;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 5;
-        InstrTable[0x11] = instr;
+        ModelTable[0x11] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 4;
-        InstrTable[0x15] = instr;
+        ModelTable[0x15] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 4;
-        InstrTable[0x1D] = instr;
+        ModelTable[0x1D] = instr;
         instr.addr = &mos6502::Addr_ABY;
         instr.code = &mos6502::Op_ORA;
         instr.cycles = 4;
-        InstrTable[0x19] = instr;
+        ModelTable[0x19] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_PHA;
         instr.cycles = 3;
-        InstrTable[0x48] = instr;
+        ModelTable[0x48] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_PHP;
         instr.cycles = 3;
-        InstrTable[0x08] = instr;
+        ModelTable[0x08] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_PLA;
         instr.cycles = 4;
-        InstrTable[0x68] = instr;
+        ModelTable[0x68] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_PLP;
         instr.cycles = 4;
-        InstrTable[0x28] = instr;
+        ModelTable[0x28] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_ROL;
         instr.cycles = 6;
-        InstrTable[0x2E] = instr;
+        ModelTable[0x2E] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_ROL;
         instr.cycles = 5;
-        InstrTable[0x26] = instr;
+        ModelTable[0x26] = instr;
         instr.addr = &mos6502::Addr_ACC;
         instr.code = &mos6502::Op_ROL_ACC;
         instr.cycles = 2;
-        InstrTable[0x2A] = instr;
+        ModelTable[0x2A] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_ROL;
         instr.cycles = 6;
-        InstrTable[0x36] = instr;
+        ModelTable[0x36] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_ROL;
         instr.cycles = 7;
-        InstrTable[0x3E] = instr;
+        ModelTable[0x3E] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_ROR;
         instr.cycles = 6;
-        InstrTable[0x6E] = instr;
+        ModelTable[0x6E] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_ROR;
         instr.cycles = 5;
-        InstrTable[0x66] = instr;
+        ModelTable[0x66] = instr;
         instr.addr = &mos6502::Addr_ACC;
         instr.code = &mos6502::Op_ROR_ACC;
         instr.cycles = 2;
-        InstrTable[0x6A] = instr;
+        ModelTable[0x6A] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_ROR;
         instr.cycles = 6;
-        InstrTable[0x76] = instr;
+        ModelTable[0x76] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_ROR;
         instr.cycles = 7;
-        InstrTable[0x7E] = instr;
+        ModelTable[0x7E] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_RTI;
         instr.cycles = 6;
-        InstrTable[0x40] = instr;
+        ModelTable[0x40] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_RTS;
         instr.cycles = 6;
-        InstrTable[0x60] = instr;
+        ModelTable[0x60] = instr;
 
         instr.addr = &mos6502::Addr_IMM;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 2;
-        InstrTable[0xE9] = instr;
+        ModelTable[0xE9] = instr;
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 4;
-        InstrTable[0xED] = instr;
+        ModelTable[0xED] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 3;
-        InstrTable[0xE5] = instr;
+        ModelTable[0xE5] = instr;
         instr.addr = &mos6502::Addr_INX;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 6;
-        InstrTable[0xE1] = instr;
+        ModelTable[0xE1] = instr;
         instr.addr = &mos6502::Addr_INY;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 5;
-        InstrTable[0xF1] = instr;
+        ModelTable[0xF1] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 4;
-        InstrTable[0xF5] = instr;
+        ModelTable[0xF5] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 4;
-        InstrTable[0xFD] = instr;
+        ModelTable[0xFD] = instr;
         instr.addr = &mos6502::Addr_ABY;
         instr.code = &mos6502::Op_SBC;
         instr.cycles = 4;
-        InstrTable[0xF9] = instr;
+        ModelTable[0xF9] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_SEC;
         instr.cycles = 2;
-        InstrTable[0x38] = instr;
+        ModelTable[0x38] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_SED;
         instr.cycles = 2;
-        InstrTable[0xF8] = instr;
+        ModelTable[0xF8] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_SEI;
         instr.cycles = 2;
-        InstrTable[0x78] = instr;
+        ModelTable[0x78] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 4;
-        InstrTable[0x8D] = instr;
+        ModelTable[0x8D] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 3;
-        InstrTable[0x85] = instr;
+        ModelTable[0x85] = instr;
         instr.addr = &mos6502::Addr_INX;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 6;
-        InstrTable[0x81] = instr;
+        ModelTable[0x81] = instr;
         instr.addr = &mos6502::Addr_INY;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 6;
-        InstrTable[0x91] = instr;
+        ModelTable[0x91] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 4;
-        InstrTable[0x95] = instr;
+        ModelTable[0x95] = instr;
         instr.addr = &mos6502::Addr_ABX;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 5;
-        InstrTable[0x9D] = instr;
+        ModelTable[0x9D] = instr;
         instr.addr = &mos6502::Addr_ABY;
         instr.code = &mos6502::Op_STA;
         instr.cycles = 5;
-        InstrTable[0x99] = instr;
+        ModelTable[0x99] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_STX;
         instr.cycles = 4;
-        InstrTable[0x8E] = instr;
+        ModelTable[0x8E] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_STX;
         instr.cycles = 3;
-        InstrTable[0x86] = instr;
+        ModelTable[0x86] = instr;
         instr.addr = &mos6502::Addr_ZEY;
         instr.code = &mos6502::Op_STX;
         instr.cycles = 4;
-        InstrTable[0x96] = instr;
+        ModelTable[0x96] = instr;
 
         instr.addr = &mos6502::Addr_ABS;
         instr.code = &mos6502::Op_STY;
         instr.cycles = 4;
-        InstrTable[0x8C] = instr;
+        ModelTable[0x8C] = instr;
         instr.addr = &mos6502::Addr_ZER;
         instr.code = &mos6502::Op_STY;
         instr.cycles = 3;
-        InstrTable[0x84] = instr;
+        ModelTable[0x84] = instr;
         instr.addr = &mos6502::Addr_ZEX;
         instr.code = &mos6502::Op_STY;
         instr.cycles = 4;
-        InstrTable[0x94] = instr;
+        ModelTable[0x94] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_TAX;
         instr.cycles = 2;
-        InstrTable[0xAA] = instr;
+        ModelTable[0xAA] = instr;
 
         instr.addr = &mos6502::Addr_IMP;
         instr.code = &mos6502::Op_TAY;
         instr.cycles = 2;
-        InstrTable[0xA8] = instr;
+        ModelTable[0xA8] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_TSX;
+        instr.cycles = 2;
+        ModelTable[0xBA] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_TXA;
+        instr.cycles = 2;
+        ModelTable[0x8A] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_TXS;
+        instr.cycles = 2;
+        ModelTable[0x9A] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_TYA;
+        instr.cycles = 2;
+        ModelTable[0x98] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_TRAP;
+        instr.cycles = 0;
+        ModelTable[TRAP_OPCODE] = instr;
+
+        if(cmos)
+        {
+            BuildCmosTable();
+        }
+        else
+        {
+            BuildUndocumentedTable();
+        }
+        if(rockwell)
+        {
+            BuildBitTable<0>();
+            BuildBitTable<1>();
+            BuildBitTable<2>();
+            BuildBitTable<3>();
+            BuildBitTable<4>();
+            BuildBitTable<5>();
+            BuildBitTable<6>();
+            BuildBitTable<7>();
+        }
+        if(wdc)
+        {
+            instr.addr = &mos6502::Addr_IMP;
+            instr.code = &mos6502::Op_WAI;
+            instr.cycles = 3;
+            ModelTable[0xCB] = instr;
+
+            instr.addr = &mos6502::Addr_IMP;
+            instr.code = &mos6502::Op_STP;
+            instr.cycles = 3;
+            ModelTable[0xDB] = instr;
+        }
+        BuildPageCrossTable();
+        return true;
+    }
+
+    static void BuildCmosTable()
+    {
+        Instr instr;
+
+        // (zp) addressing.
+        instr.addr = &mos6502::Addr_ZPI;
+        instr.cycles = 5;
+        instr.code = &mos6502::Op_ORA;
+        ModelTable[0x12] = instr;
+        instr.code = &mos6502::Op_AND;
+        ModelTable[0x32] = instr;
+        instr.code = &mos6502::Op_EOR;
+        ModelTable[0x52] = instr;
+        instr.code = &mos6502::Op_ADC;
+        ModelTable[0x72] = instr;
+        instr.code = &mos6502::Op_STA;
+        ModelTable[0x92] = instr;
+        instr.code = &mos6502::Op_LDA;
+        ModelTable[0xB2] = instr;
+        instr.code = &mos6502::Op_CMP;
+        ModelTable[0xD2] = instr;
+        instr.code = &mos6502::Op_SBC;
+        ModelTable[0xF2] = instr;
+
+        instr.addr = &mos6502::Addr_IMM;
+        instr.code = &mos6502::Op_BIT_IMM;
+        instr.cycles = 2;
+        ModelTable[0x89] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_BIT;
+        instr.cycles = 4;
+        ModelTable[0x34] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_BIT;
+        instr.cycles = 4;
+        ModelTable[0x3C] = instr;
+
+        instr.addr = &mos6502::Addr_REL;
+        instr.code = &mos6502::Op_BRA;
+        instr.cycles = 2;
+        ModelTable[0x80] = instr;
+
+        instr.addr = &mos6502::Addr_ACC;
+        instr.code = &mos6502::Op_DEC_ACC;
+        instr.cycles = 2;
+        ModelTable[0x3A] = instr;
+
+        instr.addr = &mos6502::Addr_ACC;
+        instr.code = &mos6502::Op_INC_ACC;
+        instr.cycles = 2;
+        ModelTable[0x1A] = instr;
+
+        instr.addr = &mos6502::Addr_ABI;
+        instr.code = &mos6502::Op_JMP;
+        instr.cycles = 6;
+        ModelTable[0x6C] = instr;
+        instr.addr = &mos6502::Addr_AIX;
+        instr.code = &mos6502::Op_JMP;
+        instr.cycles = 6;
+        ModelTable[0x7C] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_PHX;
+        instr.cycles = 3;
+        ModelTable[0xDA] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_PHY;
+        instr.cycles = 3;
+        ModelTable[0x5A] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_PLX;
+        instr.cycles = 4;
+        ModelTable[0xFA] = instr;
+
+        instr.addr = &mos6502::Addr_IMP;
+        instr.code = &mos6502::Op_PLY;
+        instr.cycles = 4;
+        ModelTable[0x7A] = instr;
+
+        // Shifts on abs,X no longer pay the dummy cycle.
+        ModelTable[0x1E].cycles = 6;
+        ModelTable[0x3E].cycles = 6;
+        ModelTable[0x5E].cycles = 6;
+        ModelTable[0x7E].cycles = 6;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_STZ;
+        instr.cycles = 3;
+        ModelTable[0x64] = instr;
+        instr.addr = &mos6502::Addr_ZEX;
+        instr.code = &mos6502::Op_STZ;
+        instr.cycles = 4;
+        ModelTable[0x74] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_STZ;
+        instr.cycles = 4;
+        ModelTable[0x9C] = instr;
+        instr.addr = &mos6502::Addr_ABX;
+        instr.code = &mos6502::Op_STZ;
+        instr.cycles = 5;
+        ModelTable[0x9E] = instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_TRB;
+        instr.cycles = 5;
+        ModelTable[0x14] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_TRB;
+        instr.cycles = 6;
+        ModelTable[0x1C] = instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::Op_TSB;
+        instr.cycles = 5;
+        ModelTable[0x04] = instr;
+        instr.addr = &mos6502::Addr_ABS;
+        instr.code = &mos6502::Op_TSB;
+        instr.cycles = 6;
+        ModelTable[0x0C] = instr;
+    }
+
+    static void SetUndocumented(uint8_t opcode, AddrExec addr, CodeExec code, uint8_t cycles)
+    {
+        Instr instr;
+
+        instr.addr = addr;
+        instr.code = code;
+        instr.cycles = cycles;
+        ModelTable[opcode] = instr;
+        Undocumented[opcode] = true;
+    }
+
+    // The stable undocumented NMOS opcodes. The unstable ones (XAA, LXA, SHA,
+    // SHX, SHY, TAS, LAS) and the JAMs stay illegal.
+    static void BuildUndocumentedTable()
+    {
+        // Read-modify-write then ALU, one column per operation.
+        static const struct { uint8_t base; CodeExec code; } rmw[] = {
+            { 0x00, &mos6502::Op_SLO },
+            { 0x20, &mos6502::Op_RLA },
+            { 0x40, &mos6502::Op_SRE },
+            { 0x60, &mos6502::Op_RRA },
+            { 0xC0, &mos6502::Op_DCP },
+            { 0xE0, &mos6502::Op_ISC },
+        };
+        for(const auto& op : rmw)
+        {
+            SetUndocumented(op.base | 0x07, &mos6502::Addr_ZER, op.code, 5);
+            SetUndocumented(op.base | 0x17, &mos6502::Addr_ZEX, op.code, 6);
+            SetUndocumented(op.base | 0x0F, &mos6502::Addr_ABS, op.code, 6);
+            SetUndocumented(op.base | 0x1F, &mos6502::Addr_ABX, op.code, 7);
+            SetUndocumented(op.base | 0x1B, &mos6502::Addr_ABY, op.code, 7);
+            SetUndocumented(op.base | 0x03, &mos6502::Addr_INX, op.code, 8);
+            SetUndocumented(op.base | 0x13, &mos6502::Addr_INY, op.code, 8);
+        }
+
+        SetUndocumented(0x87, &mos6502::Addr_ZER, &mos6502::Op_SAX, 3);
+        SetUndocumented(0x97, &mos6502::Addr_ZEY, &mos6502::Op_SAX, 4);
+        SetUndocumented(0x8F, &mos6502::Addr_ABS, &mos6502::Op_SAX, 4);
+        SetUndocumented(0x83, &mos6502::Addr_INX, &mos6502::Op_SAX, 6);
+
+        SetUndocumented(0xA7, &mos6502::Addr_ZER, &mos6502::Op_LAX, 3);
+        SetUndocumented(0xB7, &mos6502::Addr_ZEY, &mos6502::Op_LAX, 4);
+        SetUndocumented(0xAF, &mos6502::Addr_ABS, &mos6502::Op_LAX, 4);
+        SetUndocumented(0xBF, &mos6502::Addr_ABY, &mos6502::Op_LAX, 4);
+        SetUndocumented(0xA3, &mos6502::Addr_INX, &mos6502::Op_LAX, 6);
+        SetUndocumented(0xB3, &mos6502::Addr_INY, &mos6502::Op_LAX, 5);
+
+        SetUndocumented(0x0B, &mos6502::Addr_IMM, &mos6502::Op_ANC, 2);
+        SetUndocumented(0x2B, &mos6502::Addr_IMM, &mos6502::Op_ANC, 2);
+        SetUndocumented(0x4B, &mos6502::Addr_IMM, &mos6502::Op_ALR, 2);
+        SetUndocumented(0x6B, &mos6502::Addr_IMM, &mos6502::Op_ARR, 2);
+        SetUndocumented(0xCB, &mos6502::Addr_IMM, &mos6502::Op_SBX, 2);
+        SetUndocumented(0xEB, &mos6502::Addr_IMM, &mos6502::Op_SBC, 2);
+
+        // NOPs of every length.
+        static const uint8_t imp[] = { 0x1A, 0x3A, 0x5A, 0x7A, 0xDA, 0xFA };
+        for(uint8_t op : imp) SetUndocumented(op, &mos6502::Addr_IMP, &mos6502::Op_NOP, 2);
+        static const uint8_t imm[] = { 0x80, 0x82, 0x89, 0xC2, 0xE2 };
+        for(uint8_t op : imm) SetUndocumented(op, &mos6502::Addr_IMM, &mos6502::Op_NOP, 2);
+        static const uint8_t zer[] = { 0x04, 0x44, 0x64 };
+        for(uint8_t op : zer) SetUndocumented(op, &mos6502::Addr_ZER, &mos6502::Op_NOP, 3);
+        static const uint8_t zex[] = { 0x14, 0x34, 0x54, 0x74, 0xD4, 0xF4 };
+        for(uint8_t op : zex) SetUndocumented(op, &mos6502::Addr_ZEX, &mos6502::Op_NOP, 4);
+        SetUndocumented(0x0C, &mos6502::Addr_ABS, &mos6502::Op_NOP, 4);
+        static const uint8_t abx[] = { 0x1C, 0x3C, 0x5C, 0x7C, 0xDC, 0xFC };
+        for(uint8_t op : abx) SetUndocumented(op, &mos6502::Addr_ABX, &mos6502::Op_NOP, 4);
+    }
+
+    template<int bit>
+    static void BuildBitTable()
+    {
+        Instr instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::template Op_RMB<bit>;
+        instr.cycles = 5;
+        ModelTable[0x07 | bit << 4] = instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::template Op_SMB<bit>;
+        instr.cycles = 5;
+        ModelTable[0x87 | bit << 4] = instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::template Op_BBR<bit>;
+        instr.cycles = 5;
+        ModelTable[0x0F | bit << 4] = instr;
+
+        instr.addr = &mos6502::Addr_ZER;
+        instr.code = &mos6502::template Op_BBS<bit>;
+        instr.cycles = 5;
+        ModelTable[0x8F | bit << 4] = instr;
+    }
+
+    uint16_t Addr_ACC()
+    {
+        return 0; // Not used.
+    }
+
+    uint16_t Addr_IMM()
+    {
+        return pc++;
+    }
+
+    uint16_t Addr_ABS()
+    {
+        uint16_t addrL;
+        uint16_t addrH;
+        uint16_t addr;
+
+        addrL = Read(pc++);
+        addrH = Read(pc++);
+
+        addr = addrL + (addrH << 8);
+
+        return addr;
+    }
+
+    uint16_t Addr_ZER()
+    {
+        return Read(pc++);
+    }
+
+    uint16_t Addr_IMP()
+    {
+        return 0; // Not used.
+    }
+
+    uint16_t Addr_REL()
+    {
+        uint16_t offset;
+        uint16_t addr;
+
+        offset = (uint16_t)Read(pc++);
+        if (offset & 0x80) offset |= 0xFF00;
+        addr = pc + (int16_t)offset;
+        return addr;
+    }
+
+    uint16_t Addr_ABI()
+    {
+        uint16_t addrL;
+        uint16_t addrH;
+        uint16_t effL;
+        uint16_t effH;
+        uint16_t abs;
+        uint16_t addr;
+
+        addrL = Read(pc++);
+        addrH = Read(pc++);
+
+        abs = (addrH << 8) | addrL;
+
+        effL = Read(abs);
+
+        // The NMOS part does not carry into the high byte of the pointer.
+        if(cmos)
+        {
+            effH = Read(abs + 1);
+        }
+        else
+        {
+            effH = Read((abs & 0xFF00) + ((abs + 1) & 0x00FF) );
+        }
+
+        addr = effL + 0x100 * effH;
+
+        return addr;
+    }
+
+    uint16_t Addr_ZEX()
+    {
+        uint16_t addr = (Read(pc++) + X) % 256;
+        return addr;
+    }
+
+    uint16_t Addr_ZEY()
+    {
+        uint16_t addr = (Read(pc++) + Y) % 256;
+        return addr;
+    }
+
+    uint16_t Addr_ABX()
+    {
+        uint16_t addr;
+        uint16_t addrL;
+        uint16_t addrH;
+
+        addrL = Read(pc++);
+        addrH = Read(pc++);
+
+        addr = addrL + (addrH << 8) + X;
+        return addr;
+    }
+
+    uint16_t Addr_ABY()
+    {
+        uint16_t addr;
+        uint16_t addrL;
+        uint16_t addrH;
+
+        addrL = Read(pc++);
+        addrH = Read(pc++);
+
+        addr = addrL + (addrH << 8) + Y;
+        return addr;
+    }
+
+
+    uint16_t Addr_INX()
+    {
+        uint16_t zeroL;
+        uint16_t zeroH;
+        uint16_t addr;
+
+        zeroL = (Read(pc++) + X) % 256;
+        zeroH = (zeroL + 1) % 256;
+        addr = Read(zeroL) + (Read(zeroH) << 8);
+
+        return addr;
+    }
+
+    uint16_t Addr_INY()
+    {
+        uint16_t zeroL;
+        uint16_t zeroH;
+        uint16_t addr;
+
+        zeroL = Read(pc++);
+        zeroH = (zeroL + 1) % 256;
+        addr = Read(zeroL) + (Read(zeroH) << 8) + Y;
+
+        return addr;
+    }
+
+    // Indexed reads take a cycle more when the index carries into the high
+    // byte of the address. Writes and read-modify-writes always pay it.
+    uint16_t Addr_ABX_P()
+    {
+        uint16_t addr = Addr_ABX();
+        if((addr ^ (uint16_t) (addr - X)) & 0xFF00) extraCycles++;
+        return addr;
+    }
+
+    uint16_t Addr_ABY_P()
+    {
+        uint16_t addr = Addr_ABY();
+        if((addr ^ (uint16_t) (addr - Y)) & 0xFF00) extraCycles++;
+        return addr;
+    }
+
+    uint16_t Addr_INY_P()
+    {
+        uint16_t addr = Addr_INY();
+        if((addr ^ (uint16_t) (addr - Y)) & 0xFF00) extraCycles++;
+        return addr;
+    }
+
+    uint16_t Addr_ZPI()
+    {
+        uint16_t zeroL;
+        uint16_t zeroH;
+        uint16_t addr;
+
+        zeroL = Read(pc++);
+        zeroH = (zeroL + 1) % 256;
+        addr = Read(zeroL) + (Read(zeroH) << 8);
+
+        return addr;
+    }
+
+    uint16_t Addr_AIX()
+    {
+        uint16_t addrL;
+        uint16_t addrH;
+        uint16_t abs;
+        uint16_t addr;
+
+        addrL = Read(pc++);
+        addrH = Read(pc++);
+
+        abs = (addrL + (addrH << 8) + X) & 0xFFFF;
+        addr = Read(abs) + (Read((abs + 1) & 0xFFFF) << 8);
+
+        return addr;
+    }
+
+    void Reset(uint16_t start)
+    {
+        Write(rstVectorH, start >> 8);
+        Write(rstVectorL, start & 0xFF);
+
+        A = 0x00;
+        Y = 0x00;
+        X = 0x00;
+
+        pc = (Read(rstVectorH) << 8) + Read(rstVectorL); // Load PC from reset vector.
+
+        sp = 0xFD;
+
+        // Above the stack pointer is where a caller's return address would be.
+        if(sanitize) MarkInitialized(0x0100 + sp + 1, 0xFF - sp);
+
+        status |= CONSTANT;
+
+        stopReason = STOP_NONE;
+        stopPc = pc;
+        waiting = false;
+        stopped = false;
+        extraCycles = 0;
+    }
+
+    void StackPush(uint8_t byte)
+    {
+        Write(0x0100 + sp, byte);
+        if(sp == 0x00)
+        {
+            sp = 0xFF;
+            if(sanitize) Report(SAN_STACK_OVERFLOW, 0x0100);
+        }
+        else sp--;
+    }
+
+    uint8_t StackPop()
+    {
+        if(sp == 0xFF)
+        {
+            sp = 0x00;
+            if(sanitize) Report(SAN_STACK_UNDERFLOW, 0x01FF);
+        }
+        else sp++;
+        return Read(0x0100 + sp);
+    }
+
+    void IRQ()
+    {
+        // A masked IRQ still wakes WAI, which then carries on with the next instruction.
+        waiting = false;
+        if(!IF_INTERRUPT())
+        {
+            SET_BREAK(0);
+            StackPush((pc >> 8) & 0xFF);
+            StackPush(pc & 0xFF);
+            StackPush(status);
+            SET_INTERRUPT(1);
+            if(cmos) SET_DECIMAL(0);
+            pc = (Read(irqVectorH) << 8) + Read(irqVectorL);
+        }
+    }
+
+    void NMI()
+    {
+        waiting = false;
+        SET_BREAK(0);
+        StackPush((pc >> 8) & 0xFF);
+        StackPush(pc & 0xFF);
+        StackPush(status);
+        SET_INTERRUPT(1);
+        if(cmos) SET_DECIMAL(0);
+        pc = (Read(nmiVectorH) << 8) + Read(nmiVectorL);
+    }
+
+    // Run instrumentation, called after every instruction. The default does
+    // nothing and compiles away.
+    struct NoProbe
+    {
+        void operator()(mos6502&, uint16_t, uint8_t) {}
+    };
+
+    // Counts executions per opcode.
+    struct OpcodeCounter
+    {
+        uint64_t count[257] = {};
+
+        void operator()(mos6502&, uint16_t opcode, uint8_t)
+        {
+            count[opcode]++;
+        }
+    };
+
+    // Counts, per instruction address, the executions of branches and
+    // indexed reads that paid no, one or two penalty cycles.
+    struct PenaltyCounter
+    {
+        std::vector<std::array<uint32_t, 3> > counts;
+        std::vector<uint16_t> touched;
+        bool penalized[257] = {};
+        bool branch[257] = {};
+
+        PenaltyCounter(mos6502& cpu) : counts(65536)
+        {
+            for(int i = 0; i < 256; i++)
+            {
+                const Instr& instr = cpu.InstrTable[i];
+                branch[i] = instr.addr == &mos6502::Addr_REL || (rockwell && (i & 0x0F) == 0x0F);
+                penalized[i] = branch[i] || instr.addr == &mos6502::Addr_ABX_P
+                    || instr.addr == &mos6502::Addr_ABY_P || instr.addr == &mos6502::Addr_INY_P;
+            }
+        }
+
+        void operator()(mos6502& cpu, uint16_t opcode, uint8_t cycles)
+        {
+            if(penalized[opcode])
+            {
+                std::array<uint32_t, 3>& c = counts[cpu.opPc];
+                if(c[0] + c[1] + c[2] == 0)
+                {
+                    touched.push_back(cpu.opPc);
+                }
+                c[std::min(cycles - cpu.InstrTable[opcode].cycles, 2)]++;
+            }
+        }
+    };
+
+    // Counts executions per opcode, split by the cycles they took and by
+    // the decimal flag, so that taken branches and page crossings can be
+    // told apart from the decimal mode cycle afterwards. Collection is one
+    // increment and one compare for the lowest stack pointer.
+    struct StatsCounter
+    {
+        uint64_t count[257][32] = {};
+        uint8_t lowestSp = 0xFF;
+
+        void operator()(mos6502& cpu, uint16_t opcode, uint8_t cycles)
+        {
+            count[opcode][(cycles & 15) | (cpu.status & DECIMAL) << 1]++;
+            lowestSp = std::min(lowestSp, cpu.sp);
+        }
+    };
+
+    void ScheduleIRQ(uint64_t at, uint64_t period = 0)
+    {
+        irqAt = at;
+        irqPeriod = period;
+    }
+
+    void ScheduleNMI(uint64_t at, uint64_t period = 0)
+    {
+        nmiAt = at;
+        nmiPeriod = period;
+    }
+
+    // Paces waiting for interrupts to a guest clock of hz.
+    void SetClock(double hz)
+    {
+        clockHz = hz;
+        clockEpoch = std::chrono::steady_clock::now();
+        clockEpochCycle = cycleCount;
+    }
+
+    std::chrono::steady_clock::time_point Deadline(uint64_t cycle)
+    {
+        double seconds = (cycle - clockEpochCycle) / clockHz;
+        return clockEpoch + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    // Blocks the host thread until the wall clock catches up with cycle.
+    void SleepUntil(uint64_t cycle)
+    {
+        std::this_thread::sleep_until(Deadline(cycle));
+    }
+
+    StopReason RunRealtime(int64_t cyclesRemaining, double hz, double sliceHz)
+    {
+        NoProbe probe;
+        return RunRealtime(cyclesRemaining, hz, sliceHz, probe);
+    }
+
+    // Runs at hz guest cycles per second, sliceHz slices at a time. Each
+    // slice sleeps until the wall clock time of its last cycle, which is
+    // taken from the epoch rather than the previous slice so that sleep
+    // overshoot does not accumulate. A slice finishing more than a tenth of
+    // a slice after its deadline counts as missed, and one more than a
+    // second behind moves the epoch instead of racing to catch up.
+    template<typename Probe>
+    StopReason RunRealtime(int64_t cyclesRemaining, double hz, double sliceHz, Probe& probe)
+    {
+        int64_t slice = hz / sliceHz;
+        if(slice < 1)
+        {
+            slice = 1;
+        }
+        SetClock(hz);
+        while(cyclesRemaining > 0)
+        {
+            uint64_t start = cycleCount;
+            StopReason reason = Run(slice < cyclesRemaining ? slice : cyclesRemaining, probe);
+            if(reason != STOP_BUDGET)
+            {
+                return reason;
+            }
+            cyclesRemaining -= cycleCount - start;
+            slices++;
+            std::chrono::steady_clock::time_point due = Deadline(cycleCount);
+            double late = std::chrono::duration<double>(std::chrono::steady_clock::now() - due).count();
+            if(late > 0.1 / sliceHz)
+            {
+                missedDeadlines++;
+                if(late > worstLateness)
+                {
+                    worstLateness = late;
+                }
+                if(late > 1.0)
+                {
+                    SetClock(hz);
+                }
+                continue;
+            }
+            std::this_thread::sleep_until(due);
+        }
+        return STOP_BUDGET;
+    }
+
+    // Stops Run after wall clock seconds from now.
+    void SetTimeout(double seconds)
+    {
+        hasDeadline = true;
+        deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    void Stop(StopReason reason, uint16_t at)
+    {
+        stopReason = reason;
+        stopPc = at;
+    }
+
+    void ServiceInterrupts()
+    {
+        if(cycleCount >= nmiAt)
+        {
+            nmiAt = nmiPeriod ? nmiAt + nmiPeriod : NEVER;
+            NMI();
+            cycleCount += 7;
+        }
+        if(cycleCount >= irqAt)
+        {
+            irqAt = irqPeriod ? irqAt + irqPeriod : NEVER;
+            irqLine = true;
+        }
+        if(irqLine)
+        {
+            bool masked = IF_INTERRUPT();
+            IRQ();
+            if(!masked)
+            {
+                irqLine = false;
+                cycleCount += 7;
+            }
+        }
+    }
+
+    StopReason Run(int64_t cyclesRemaining, CycleMethod cycleMethod = CYCLE_COUNT)
+    {
+        NoProbe probe;
+        return Run(cyclesRemaining, probe, cycleMethod);
+    }
+
+    // Runs in slices between scheduled interrupts and deadline checks, so the
+    // instruction loop itself only ever compares against one cycle count.
+    template<typename Probe>
+    StopReason Run(int64_t cyclesRemaining, Probe& probe, CycleMethod cycleMethod = CYCLE_COUNT)
+    {
+        uint16_t opcode;
+
+        if(stopped)
+        {
+            return stopReason;
+        }
+        stopReason = STOP_NONE;
+        while(stopReason == STOP_NONE)
+        {
+            if(cyclesRemaining <= 0)
+            {
+                Stop(STOP_BUDGET, pc);
+                break;
+            }
+            if(hasDeadline && std::chrono::steady_clock::now() >= deadline)
+            {
+                Stop(STOP_DEADLINE, pc);
+                break;
+            }
+            ServiceInterrupts();
+            if(waiting)
+            {
+                uint64_t wake = nmiAt < irqAt ? nmiAt : irqAt;
+                if(wake == NEVER)
+                {
+                    Stop(STOP_WAIT, pc);
+                    break;
+                }
+                uint64_t skip = wake - cycleCount;
+                if(cycleMethod == CYCLE_COUNT && skip > (uint64_t) cyclesRemaining)
+                {
+                    skip = cyclesRemaining;
+                }
+                if(hasDeadline && skip > deadlineBlock)
+                {
+                    skip = deadlineBlock;
+                }
+                if(clockHz > 0)
+                {
+                    SleepUntil(cycleCount + skip);
+                }
+                idleCycles += skip;
+                cycleCount += skip;
+                if(cycleMethod == CYCLE_COUNT)
+                {
+                    cyclesRemaining -= skip;
+                }
+                continue;
+            }
+            nextEvent = nmiAt < irqAt ? nmiAt : irqAt;
+            if(hasDeadline && nextEvent - cycleCount > deadlineBlock)
+            {
+                nextEvent = cycleCount + deadlineBlock;
+            }
+            while(cyclesRemaining > 0 && cycleCount < nextEvent && !waiting && stopReason == STOP_NONE)
+            {
+                uint8_t cycles = Step(opcode);
+                cyclesRemaining -= cycleMethod == CYCLE_COUNT ? cycles : 1;
+                probe(*this, opcode, cycles);
+            }
+        }
+        return stopReason;
+    }
+
+    // Executes the instruction at pc, without servicing interrupts or
+    // checking any limit, and returns its cycles.
+    uint8_t Step(uint16_t& opcode)
+    {
+        // Fetch.
+        opPc = pc;
+        opcode = Fetch(pc++);
+
+        // Decode.
+        Instr instr = InstrTable[opcode];
+
+        // Execute.
+        Exec(instr);
+        uint8_t cycles = instr.cycles + extraCycles;
+        extraCycles = 0;
+        cycleCount += cycles;
+        return cycles;
+    }
+
+    // A taken branch costs a cycle, and another when it lands on a page
+    // other than that of the next instruction.
+    void Branch(uint16_t src)
+    {
+        if(src == opPc) Idle();
+        extraCycles += (src ^ pc) & 0xFF00 ? 2 : 1;
+        pc = src;
+    }
+
+    // A loop branching to itself can only be left through an interrupt, so
+    // when one is on its way wait for it the same way WAI does. Otherwise it
+    // is stuck for good, which some test suites use to signal completion.
+    void Idle()
+    {
+        if(nmiAt != NEVER || (irqAt != NEVER && !IF_INTERRUPT()))
+        {
+            waiting = true;
+        }
+        else if(exitOnLoop)
+        {
+            Stop(STOP_EXIT, opPc);
+        }
+    }
+
+    void Exec(Instr i)
+    {
+        uint16_t src = (this->*i.addr)();
+        (this->*i.code)(src);
+    }
+
+    void Dump()
+    {
+        puts("end of stack - emulation complete");
+        puts("ZERO PAGE");
+        int w = 16;
+        for(int j = 0; j < w; j++)
+        {
+            for(int i = 0; i < w; i++)
+                printf("%02X ", Peek(i + w * j));
+            printf("\n");
+        }
+        puts("STACK");
+        for(int j = 0; j < w; j++)
+        {
+            for(int i = 0; i < w; i++)
+                printf("%02X ", Peek(0x1FF - i + w * j));
+            printf("\n");
+        }
+        printf("A  : %3d\n", A);
+        printf("X  : %3d\n", X);
+        printf("Y  : %3d\n", Y);
+        printf("SP : 0x%02X\n", sp);
+        printf("S  : 0x%02X\n", status);
+        printf("PC : 0x%04X\n", pc);
+    }
+
+    void Op_TRAP(uint16_t src)
+    {
+        pc--;
+        ignoreTrapAt = pc;
+        Stop(trapReason, pc);
+    }
+
+    void Op_ILLEGAL(uint16_t src)
+    {
+        Stop(STOP_ILLEGAL, pc - 1);
+    }
+
+    void Op_ADC(uint16_t src)
+    {
+        AddWithCarry(Read(src));
+    }
+
+    void AddWithCarry(uint8_t m)
+    {
+        unsigned int tmp = m + A + (IF_CARRY() ? 1 : 0);
+        SET_ZERO(!(tmp & 0xFF));
+        if (IF_DECIMAL())
+        {
+            if (((A & 0xF) + (m & 0xF) + (IF_CARRY() ? 1 : 0)) > 9) tmp += 6;
+            SET_NEGATIVE(tmp & 0x80);
+            SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
+            if (tmp > 0x99)
+            {
+                tmp += 96;
+            }
+            SET_CARRY(tmp > 0x99);
+        }
+        else
+        {
+            SET_NEGATIVE(tmp & 0x80);
+            SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
+            SET_CARRY(tmp > 0xFF);
+        }
+
+        A = tmp & 0xFF;
+
+        // The CMOS parts spend a cycle fixing up N and Z in decimal mode.
+        if(cmos && IF_DECIMAL())
+        {
+            SET_NEGATIVE(A & 0x80);
+            SET_ZERO(!A);
+            extraCycles++;
+        }
+    }
+
+    void Op_AND(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        uint8_t res = m & A;
+        SET_NEGATIVE(res & 0x80);
+        SET_ZERO(!res);
+        A = res;
+    }
+
+    void Op_ASL(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_CARRY(m & 0x80);
+        m <<= 1;
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_ASL_ACC(uint16_t src)
+    {
+        uint8_t m = A;
+        SET_CARRY(m & 0x80);
+        m <<= 1;
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_BCC(uint16_t src)
+    {
+        if (!IF_CARRY())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BCS(uint16_t src)
+    {
+        if (IF_CARRY())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BEQ(uint16_t src)
+    {
+        if (IF_ZERO())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BIT(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        uint8_t res = m & A;
+        SET_NEGATIVE(res & 0x80);
+        status = (status & 0x3F) | (uint8_t)(m & 0xC0);
+        SET_ZERO(!res);
+    }
+
+    void Op_BIT_IMM(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_ZERO(!(m & A));
+    }
+
+    void Op_BMI(uint16_t src)
+    {
+        if (IF_NEGATIVE())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BNE(uint16_t src)
+    {
+        if (!IF_ZERO())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BPL(uint16_t src)
+    {
+        if (!IF_NEGATIVE())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BRA(uint16_t src)
+    {
+        Branch(src);
+    }
+
+    void Op_BRK(uint16_t src)
+    {
+        pc++;
+        StackPush((pc >> 8) & 0xFF);
+        StackPush(pc & 0xFF);
+        StackPush(status | BREAK);
+        SET_INTERRUPT(1);
+        if(cmos) SET_DECIMAL(0);
+        pc = (Read(irqVectorH) << 8) + Read(irqVectorL);
+    }
+
+    void Op_BRK_EXIT(uint16_t src)
+    {
+        Stop(STOP_BRK, pc - 1);
+    }
+
+    void Op_BVC(uint16_t src)
+    {
+        if (!IF_OVERFLOW())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_BVS(uint16_t src)
+    {
+        if (IF_OVERFLOW())
+        {
+            Branch(src);
+        }
+    }
+
+    void Op_CLC(uint16_t src)
+    {
+        SET_CARRY(0);
+    }
+
+    void Op_CLD(uint16_t src)
+    {
+        SET_DECIMAL(0);
+    }
+
+    void Op_CLI(uint16_t src)
+    {
+        SET_INTERRUPT(0);
+        if(irqLine) nextEvent = 0;
+    }
+
+    void Op_CLV(uint16_t src)
+    {
+        SET_OVERFLOW(0);
+    }
+
+    void Op_CMP(uint16_t src)
+    {
+        unsigned int tmp = A - Read(src);
+        SET_CARRY(tmp < 0x100);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+    }
+
+    void Op_CPX(uint16_t src)
+    {
+        unsigned int tmp = X - Read(src);
+        SET_CARRY(tmp < 0x100);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+    }
+
+    void Op_CPY(uint16_t src)
+    {
+        unsigned int tmp = Y - Read(src);
+        SET_CARRY(tmp < 0x100);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+    }
+
+    void Op_DEC(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = (m - 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_DEC_ACC(uint16_t src)
+    {
+        uint8_t m = A;
+        m = (m - 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_DEX(uint16_t src)
+    {
+        uint8_t m = X;
+        m = (m - 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        X = m;
+    }
+
+    void Op_DEY(uint16_t src)
+    {
+        uint8_t m = Y;
+        m = (m - 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Y = m;
+    }
+
+    void Op_EOR(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = A ^ m;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_INC(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = (m + 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_INC_ACC(uint16_t src)
+    {
+        uint8_t m = A;
+        m = (m + 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_INX(uint16_t src)
+    {
+        uint8_t m = X;
+        m = (m + 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        X = m;
+    }
+
+    void Op_INY(uint16_t src)
+    {
+        uint8_t m = Y;
+        m = (m + 1) % 256;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Y = m;
+    }
+
+    void Op_JMP(uint16_t src)
+    {
+        if(src == pc - 3) Idle();
+        pc = src;
+    }
+
+    void Op_JSR(uint16_t src)
+    {
+        pc--;
+        StackPush((pc >> 8) & 0xFF);
+        StackPush(pc & 0xFF);
+        if(sanitize) shadowStack.push_back({ pc, sp });
+        pc = src;
+    }
+
+    void Op_LDA(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_LDX(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        X = m;
+    }
+
+    void Op_LDY(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Y = m;
+    }
+
+    void Op_LSR(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        SET_NEGATIVE(0);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_LSR_ACC(uint16_t src)
+    {
+        uint8_t m = A;
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        SET_NEGATIVE(0);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_NOP(uint16_t src)
+    {
+    }
+
+    void Op_ORA(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = A | m;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_PHA(uint16_t src)
+    {
+        StackPush(A);
+    }
+
+    void Op_PHP(uint16_t src)
+    {
+        StackPush(status | BREAK);
+    }
+
+    void Op_PHX(uint16_t src)
+    {
+        StackPush(X);
+    }
+
+    void Op_PHY(uint16_t src)
+    {
+        StackPush(Y);
+    }
+
+    void Op_PLA(uint16_t src)
+    {
+        A = StackPop();
+        SET_NEGATIVE(A & 0x80);
+        SET_ZERO(!A);
+    }
+
+    void Op_PLP(uint16_t src)
+    {
+        status = StackPop();
+        SET_CONSTANT(1);
+        if(irqLine) nextEvent = 0;
+    }
+
+    void Op_PLX(uint16_t src)
+    {
+        X = StackPop();
+        SET_NEGATIVE(X & 0x80);
+        SET_ZERO(!X);
+    }
+
+    void Op_PLY(uint16_t src)
+    {
+        Y = StackPop();
+        SET_NEGATIVE(Y & 0x80);
+        SET_ZERO(!Y);
+    }
+
+    template<int bit>
+    void Op_RMB(uint16_t src)
+    {
+        Write(src, Read(src) & ~(1 << bit));
+    }
+
+    void Op_ROL(uint16_t src)
+    {
+        uint16_t m = Read(src);
+        m <<= 1;
+        if (IF_CARRY()) m |= 0x01;
+        SET_CARRY(m > 0xFF);
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_ROL_ACC(uint16_t src)
+    {
+        uint16_t m = A;
+        m <<= 1;
+        if (IF_CARRY()) m |= 0x01;
+        SET_CARRY(m > 0xFF);
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_ROR(uint16_t src)
+    {
+        uint16_t m = Read(src);
+        if (IF_CARRY()) m |= 0x100;
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Write(src, m);
+    }
+
+    void Op_ROR_ACC(uint16_t src)
+    {
+        uint16_t m = A;
+        if (IF_CARRY()) m |= 0x100;
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        m &= 0xFF;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_RTI(uint16_t src)
+    {
+        uint8_t lo, hi;
+
+        status = StackPop();
+
+        lo = StackPop();
+        hi = StackPop();
+
+        pc = (hi << 8) | lo;
+        if(irqLine) nextEvent = 0;
+    }
+
+    void Op_RTS(uint16_t src)
+    {
+        uint8_t lo, hi;
+
+        if(sanitize) CheckReturn();
+        lo = StackPop();
+        hi = StackPop();
+        pc = ((hi << 8) | lo) + 1;
+    }
+
+    void Op_RTS_EXIT(uint16_t src)
+    {
+        uint8_t lo, hi;
+
+        if(sanitize) CheckReturn();
+        lo = StackPop();
+        hi = StackPop();
+        if(sp == 0xFF)
+        {
+            Stop(STOP_EXIT, pc - 1);
+            return;
+        }
+        pc = ((hi << 8) | lo) + 1;
+    }
+
+    void Op_SBC(uint16_t src)
+    {
+        SubtractWithBorrow(Read(src));
+    }
+
+    void SubtractWithBorrow(uint8_t m)
+    {
+        unsigned int tmp = A - m - (IF_CARRY() ? 0 : 1);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+        SET_OVERFLOW(((A ^ tmp) & 0x80) && ((A ^ m) & 0x80));
+
+        if (IF_DECIMAL())
+        {
+            if ( ((A & 0x0F) - (IF_CARRY() ? 0 : 1)) < (m & 0x0F)) tmp -= 6;
+            if (tmp > 0x99)
+            {
+                tmp -= 0x60;
+            }
+        }
+        SET_CARRY(tmp < 0x100);
+        A = (tmp & 0xFF);
+
+        if(cmos && IF_DECIMAL())
+        {
+            SET_NEGATIVE(A & 0x80);
+            SET_ZERO(!A);
+            extraCycles++;
+        }
+    }
+
+    template<int bit>
+    void Op_SMB(uint16_t src)
+    {
+        Write(src, Read(src) | (1 << bit));
+    }
+
+    template<int bit>
+    void Op_BBR(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        uint16_t addr = Addr_REL();
+        if (!(m & (1 << bit)))
+        {
+            Branch(addr);
+        }
+    }
+
+    template<int bit>
+    void Op_BBS(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        uint16_t addr = Addr_REL();
+        if (m & (1 << bit))
+        {
+            Branch(addr);
+        }
+    }
+
+    void Op_SEC(uint16_t src)
+    {
+        SET_CARRY(1);
+    }
+
+    void Op_SED(uint16_t src)
+    {
+        SET_DECIMAL(1);
+    }
+
+    void Op_SEI(uint16_t src)
+    {
+        SET_INTERRUPT(1);
+    }
+
+    void Op_STA(uint16_t src)
+    {
+        Write(src, A);
+    }
+
+    void Op_STX(uint16_t src)
+    {
+        Write(src, X);
+    }
+
+    void Op_STY(uint16_t src)
+    {
+        Write(src, Y);
+    }
+
+    void Op_STP(uint16_t src)
+    {
+        stopped = true;
+        Stop(STOP_STP, pc - 1);
+    }
+
+    void Op_STZ(uint16_t src)
+    {
+        Write(src, 0);
+    }
+
+    void Op_TAX(uint16_t src)
+    {
+        uint8_t m = A;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        X = m;
+    }
+
+    void Op_TAY(uint16_t src)
+    {
+        uint8_t m = A;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        Y = m;
+    }
+
+    void Op_TRB(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_ZERO(!(m & A));
+        Write(src, m & ~A);
+    }
+
+    void Op_TSB(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_ZERO(!(m & A));
+        Write(src, m | A);
+    }
+
+    void Op_TSX(uint16_t src)
+    {
+        uint8_t m = sp;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        X = m;
+    }
+
+    void Op_TXA(uint16_t src)
+    {
+        uint8_t m = X;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_TXS(uint16_t src)
+    {
+        sp = X;
+    }
+
+    void Op_TYA(uint16_t src)
+    {
+        uint8_t m = Y;
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_WAI(uint16_t src)
+    {
+        waiting = true;
+    }
+
+    // Undocumented NMOS opcodes.
+
+    void Op_ALR(uint16_t src)
+    {
+        uint8_t m = A & Read(src);
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        SET_NEGATIVE(0);
+        SET_ZERO(!m);
+        A = m;
+    }
+
+    void Op_ANC(uint16_t src)
+    {
+        uint8_t m = A & Read(src);
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        SET_CARRY(m & 0x80);
+        A = m;
+    }
+
+    void Op_ARR(uint16_t src)
+    {
+        uint8_t t = A & Read(src);
+        uint8_t m = (t >> 1) | (IF_CARRY() ? 0x80 : 0x00);
+        if (IF_DECIMAL())
+        {
+            SET_NEGATIVE(IF_CARRY());
+            SET_ZERO(!m);
+            SET_OVERFLOW((t ^ m) & 0x40);
+            if (((t & 0x0F) + (t & 0x01)) > 0x05) m = (m & 0xF0) | ((m + 0x06) & 0x0F);
+            SET_CARRY(((t & 0xF0) + (t & 0x10)) > 0x50);
+            if (IF_CARRY()) m += 0x60;
+        }
+        else
+        {
+            SET_NEGATIVE(m & 0x80);
+            SET_ZERO(!m);
+            SET_CARRY(m & 0x40);
+            SET_OVERFLOW(((m >> 6) ^ (m >> 5)) & 0x01);
+        }
+        A = m;
+    }
+
+    void Op_DCP(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = (m - 1) % 256;
+        Write(src, m);
+        unsigned int tmp = A - m;
+        SET_CARRY(tmp < 0x100);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+    }
+
+    void Op_ISC(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        m = (m + 1) % 256;
+        Write(src, m);
+        SubtractWithBorrow(m);
+    }
+
+    void Op_LAX(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_NEGATIVE(m & 0x80);
+        SET_ZERO(!m);
+        A = m;
+        X = m;
+    }
+
+    void Op_RLA(uint16_t src)
+    {
+        uint16_t m = Read(src);
+        m <<= 1;
+        if (IF_CARRY()) m |= 0x01;
+        SET_CARRY(m > 0xFF);
+        m &= 0xFF;
+        Write(src, m);
+        A &= m;
+        SET_NEGATIVE(A & 0x80);
+        SET_ZERO(!A);
+    }
+
+    void Op_RRA(uint16_t src)
+    {
+        uint16_t m = Read(src);
+        if (IF_CARRY()) m |= 0x100;
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        Write(src, m);
+        AddWithCarry(m);
+    }
+
+    void Op_SAX(uint16_t src)
+    {
+        Write(src, A & X);
+    }
+
+    void Op_SBX(uint16_t src)
+    {
+        unsigned int tmp = (A & X) - Read(src);
+        SET_CARRY(tmp < 0x100);
+        SET_NEGATIVE(tmp & 0x80);
+        SET_ZERO(!(tmp & 0xFF));
+        X = tmp & 0xFF;
+    }
+
+    void Op_SLO(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_CARRY(m & 0x80);
+        m <<= 1;
+        Write(src, m);
+        A |= m;
+        SET_NEGATIVE(A & 0x80);
+        SET_ZERO(!A);
+    }
+
+    void Op_SRE(uint16_t src)
+    {
+        uint8_t m = Read(src);
+        SET_CARRY(m & 0x01);
+        m >>= 1;
+        Write(src, m);
+        A ^= m;
+        SET_NEGATIVE(A & 0x80);
+        SET_ZERO(!A);
+    }
+};
+
+template<CpuModel Model>
+typename mos6502<Model>::Instr mos6502<Model>::ModelTable[257];
+
+template<CpuModel Model>
+bool mos6502<Model>::Undocumented[256];
+
+// Checks a guest routine against a host reference over every input. Input
+// bits are stored little endian across the Input addresses, the guest is
+// called at entry as a subroutine, and the Output bytes read back as one
+// value are compared with reference(input). Cases run on all cores, each
+// thread restoring only the pages its last case dirtied.
+template<CpuModel Model>
+struct Verifier
+{
+	typedef mos6502<Model> Cpu;
+	typedef std::function<uint32_t(uint32_t)> Reference;
+	struct Mismatch
+	{
+		uint32_t input;
+		uint32_t expected;
+		uint32_t actual;
+		StopReason reason;
+	};
+
+	std::vector<uint8_t> image;
+	uint16_t entry;
+	std::vector<uint16_t> inputs;
+	std::vector<uint16_t> outputs;
+	Reference reference;
+	int64_t maxCycles;
+	int threads;
+
+	// Inputs and outputs are packed into 32 bit words, and a case runs for
+	// every input value.
+	static const size_t maxInputs = 3;
+	static const size_t maxOutputs = 4;
+
+	// Results of the last Run.
+	static const size_t maxMismatches = 16;
+	uint64_t cases;
+	uint64_t mismatchCount;
+	std::vector<Mismatch> mismatches;
+	std::vector<uint64_t> cycleHistogram;
+
+    Verifier(const uint8_t* data, size_t size, uint16_t load, uint16_t entry) : image(65536), entry(entry)
+    {
+        memcpy(image.data() + load, data, std::min(size, (size_t) (65536 - load)));
+        maxCycles = 1000000;
+        threads = 0;
+        cases = 0;
+        mismatchCount = 0;
+    }
+
+    // Adds the next byte of the input, low byte first. At most maxInputs
+    // bytes, 2^24 cases, can be given; Run refuses more.
+    Verifier& Input(uint16_t addr)
+    {
+        inputs.push_back(addr);
+        return *this;
+    }
+
+    // Adds the next byte of the output, low byte first, up to maxOutputs.
+    Verifier& Output(uint16_t addr)
+    {
+        outputs.push_back(addr);
+        return *this;
+    }
+
+    Verifier& Check(Reference ref)
+    {
+        reference = ref;
+        return *this;
+    }
+
+    // Runs every input, up to 2^24 of them, and returns the mismatch count.
+    // With more than maxInputs or maxOutputs bytes nothing runs, and the
+    // run counts as one mismatch so that callers checking for 0 fail.
+    uint64_t Run()
+    {
+        cases = 0;
+        mismatchCount = 0;
+        mismatches.clear();
+        cycleHistogram.clear();
+        if(inputs.size() > maxInputs || outputs.size() > maxOutputs)
+        {
+            printf("error: the verifier takes up to %zu input and %zu output bytes\n", maxInputs, maxOutputs);
+            mismatchCount = 1;
+            return mismatchCount;
+        }
+        cases = (uint64_t) 1 << (8 * inputs.size());
+        std::atomic<uint64_t> next(0);
+        std::mutex lock;
+        auto worker = [&]()
+        {
+            std::vector<uint8_t> ram(image);
+            std::vector<uint64_t> histogram;
+            Cpu mos { NULL, NULL };
+            mos.MapRam(ram.data());
+            mos.ExitOnRts();
+            mos.TrackDirtyPages();
+            const uint64_t block = 4096;
+            for(uint64_t first; (first = next.fetch_add(block)) < cases;)
+            {
+                for(uint64_t input = first; input < first + block && input < cases; input++)
+                {
+                    for(size_t i = 0; i < inputs.size(); i++)
+                    {
+                        mos.Write(inputs[i], input >> (8 * i));
+                    }
+                    mos.status = CONSTANT;
+                    mos.cycleCount = 0;
+                    mos.Reset(entry);
+                    StopReason reason = mos.Run(maxCycles);
+                    uint32_t actual = 0;
+                    for(size_t i = 0; i < outputs.size(); i++)
+                    {
+                        actual |= mos.Peek(outputs[i]) << (8 * i);
+                    }
+                    uint32_t expected = reference(input);
+                    if(histogram.size() <= mos.cycleCount)
+                    {
+                        histogram.resize(mos.cycleCount + 1);
+                    }
+                    histogram[mos.cycleCount]++;
+                    if(actual != expected || reason != STOP_EXIT)
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        if(mismatches.size() < maxMismatches)
+                        {
+                            mismatches.push_back({ (uint32_t) input, expected, actual, reason });
+                        }
+                        mismatchCount++;
+                    }
+                    mos.RestoreDirtyPages(image.data());
+                }
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if(cycleHistogram.size() < histogram.size())
+            {
+                cycleHistogram.resize(histogram.size());
+            }
+            for(size_t i = 0; i < histogram.size(); i++)
+            {
+                cycleHistogram[i] += histogram[i];
+            }
+        };
+        int count = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> pool;
+        for(int i = 0; i < count; i++)
+        {
+            pool.emplace_back(worker);
+        }
+        for(auto& t : pool)
+        {
+            t.join();
+        }
+        std::sort(mismatches.begin(), mismatches.end(), [](const Mismatch& a, const Mismatch& b) { return a.input < b.input; });
+        return mismatchCount;
+    }
+
+    void Report() const
+    {
+        printf("VERIFY: %llu cases, %llu mismatches\n", (unsigned long long) cases, (unsigned long long) mismatchCount);
+        for(const Mismatch& m : mismatches)
+        {
+            printf("input $%06X : expected $%06X got $%06X, %s\n", m.input, m.expected, m.actual, StopReasonName(m.reason));
+        }
+        uint64_t total = 0;
+        uint64_t min = UINT64_MAX;
+        uint64_t max = 0;
+        for(size_t i = 0; i < cycleHistogram.size(); i++)
+        {
+            if(cycleHistogram[i] > 0)
+            {
+                min = std::min(min, (uint64_t) i);
+                max = i;
+                total += cycleHistogram[i] * i;
+            }
+        }
+        if(cases > 0)
+        {
+            printf("CYCLES: min %llu max %llu mean %.2f\n", (unsigned long long) min, (unsigned long long) max, (double) total / cases);
+            for(size_t i = min; i <= max; i++)
+            {
+                if(cycleHistogram[i] > 0)
+                {
+                    printf("%6zu : %llu\n", i, (unsigned long long) cycleHistogram[i]);
+                }
+            }
+        }
+    }
+};
+
+// Static worst-case execution time of a subroutine or interrupt handler.
+// The control flow is recovered from the image starting at the entry. Each
+// instruction is charged its table cycles plus the worst of its penalties,
+// each JSR the bound of the subroutine it calls, and each loop its bound on
+// how many times its header runs per entry times its longest iteration.
+template<CpuModel Model>
+struct Wcet
+{
+	typedef mos6502<Model> Cpu;
+	typedef typename Cpu::Instr Instr;
+	enum { EXIT = -1 };
+	struct Edge
+	{
+		int to;
+		uint64_t cycles;
+	};
+	struct Node
+	{
+		uint16_t addr;
+		uint64_t cost;
+		std::vector<Edge> edges;
+	};
+	struct Loop
+	{
+		uint16_t function;
+		uint16_t header;
+		uint64_t bound;
+		uint64_t iteration;
+		uint64_t total;
+	};
+
+	Cpu& cpu;
+	std::map<uint16_t, uint64_t> bounds;
+	std::map<uint16_t, uint64_t> functions;
+	std::vector<Loop> loops;
+	std::vector<uint16_t> calling;
+	char error[64];
+
+    Wcet(Cpu& cpu) : cpu(cpu)
+    {
+        error[0] = '\0';
+    }
+
+    void Bound(uint16_t header, uint64_t bound)
+    {
+        bounds[header] = bound;
+    }
+
+    // Returns false with error set when the code cannot be bounded.
+    bool Analyze(uint16_t entry, uint64_t& cycles)
+    {
+        auto done = functions.find(entry);
+        if(done != functions.end())
+        {
+            cycles = done->second;
+            return true;
+        }
+        if(std::find(calling.begin(), calling.end(), entry) != calling.end())
+        {
+            return Fail("recursive call to $%04X", entry);
+        }
+        calling.push_back(entry);
+        bool ok = Function(entry, cycles);
+        calling.pop_back();
+        if(ok)
+        {
+            functions[entry] = cycles;
+        }
+        return ok;
+    }
+
+    bool Fail(const char* format, uint16_t addr)
+    {
+        snprintf(error, sizeof(error), format, addr);
+        return false;
+    }
+
+    // The ways out of the instruction at addr, with what each costs.
+    bool Successors(uint16_t addr, std::vector<std::pair<int32_t, uint64_t> >& out)
+    {
+        uint8_t opcode = cpu.Peek(addr);
+        const Instr& instr = cpu.InstrTable[opcode];
+        uint16_t next = addr + cpu.InstrLength(opcode);
+        uint16_t operand = cpu.Peek(addr + 1) | (cpu.Peek(addr + 2) << 8);
+        uint64_t cycles = instr.cycles;
+        out.clear();
+        if(instr.addr == &Cpu::Addr_ABX_P || instr.addr == &Cpu::Addr_ABY_P || instr.addr == &Cpu::Addr_INY_P)
+        {
+            cycles++;
+        }
+        if(Cpu::cmos && (instr.code == &Cpu::Op_ADC || instr.code == &Cpu::Op_SBC))
+        {
+            cycles++;
+        }
+        bool bit = Cpu::rockwell && (opcode & 0x0F) == 0x0F;
+        if(instr.addr == &Cpu::Addr_REL || bit)
+        {
+            uint16_t target = next + (int8_t) cpu.Peek(addr + (bit ? 2 : 1));
+            out.push_back({ target, cycles + ((target ^ next) & 0xFF00 ? 2 : 1) });
+            if(instr.code != &Cpu::Op_BRA)
+            {
+                out.push_back({ next, cycles });
+            }
+        }
+        else if(instr.code == &Cpu::Op_JMP)
+        {
+            if(instr.addr != &Cpu::Addr_ABS)
+            {
+                return Fail("computed jump at $%04X", addr);
+            }
+            out.push_back({ operand, cycles });
+        }
+        else if(instr.code == &Cpu::Op_JSR)
+        {
+            uint64_t callee;
+            if(!Analyze(operand, callee))
+            {
+                return false;
+            }
+            out.push_back({ next, cycles + callee });
+        }
+        else if(instr.code == &Cpu::Op_RTS || instr.code == &Cpu::Op_RTS_EXIT || instr.code == &Cpu::Op_RTI)
+        {
+            out.push_back({ EXIT, cycles });
+        }
+        else if(instr.code == &Cpu::Op_BRK || instr.code == &Cpu::Op_BRK_EXIT || instr.code == &Cpu::Op_STP
+            || instr.code == &Cpu::Op_WAI || instr.code == &Cpu::Op_ILLEGAL)
+        {
+            return Fail("no bound past the instruction at $%04X", addr);
+        }
+        else
+        {
+            out.push_back({ next, cycles });
+        }
+        return true;
+    }
+
+    int Find(std::vector<int>& parent, int n)
+    {
+        while(parent[n] != n)
+        {
+            n = parent[n] = parent[parent[n]];
+        }
+        return n;
+    }
+
+    // Nodes of the region reachable from first without entering skip, in
+    // topological order. Fails on a cycle, which is an irreducible loop.
+    bool Order(std::vector<Node>& nodes, std::vector<int>& parent, const std::vector<bool>& region, int first, int skip, std::vector<int>& order)
+    {
+        std::vector<uint8_t> state(nodes.size());
+        std::vector<std::pair<int, size_t> > stack { { first, 0 } };
+        state[first] = 1;
+        while(!stack.empty())
+        {
+            int n = stack.back().first;
+            size_t& e = stack.back().second;
+            if(e == nodes[n].edges.size())
+            {
+                state[n] = 2;
+                order.push_back(n);
+                stack.pop_back();
+                continue;
+            }
+            int to = nodes[n].edges[e++].to;
+            if(to == EXIT || (to = Find(parent, to)) == skip || !region[to])
+            {
+                continue;
+            }
+            if(state[to] == 1)
+            {
+                return Fail("irreducible loop at $%04X", nodes[to].addr);
+            }
+            if(state[to] == 0)
+            {
+                state[to] = 1;
+                stack.push_back({ to, 0 });
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        return true;
+    }
+
+    bool Function(uint16_t entry, uint64_t& cycles)
+    {
+        // Recover the flow graph, one node per instruction.
+        std::vector<Node> nodes;
+        std::map<uint16_t, int> index;
+        std::vector<std::pair<int32_t, uint64_t> > out;
+        index[entry] = 0;
+        nodes.push_back({ entry, 0, {} });
+        for(size_t n = 0; n < nodes.size(); n++)
+        {
+            if(!Successors(nodes[n].addr, out))
+            {
+                return false;
+            }
+            for(const auto& o : out)
+            {
+                int to = EXIT;
+                if(o.first != EXIT)
+                {
+                    auto found = index.find(o.first);
+                    if(found == index.end())
+                    {
+                        found = index.insert({ (uint16_t) o.first, (int) nodes.size() }).first;
+                        nodes.push_back({ (uint16_t) o.first, 0, {} });
+                    }
+                    to = found->second;
+                }
+                nodes[n].edges.push_back({ to, o.second });
+            }
+        }
+
+        // Back edges by depth first search give the loop headers, and each
+        // loop body is what reaches a back edge without passing its header.
+        size_t count = nodes.size();
+        std::vector<std::vector<int> > preds(count);
+        std::vector<std::vector<int> > latches(count);
+        std::vector<uint8_t> state(count);
+        std::vector<std::pair<int, size_t> > stack { { 0, 0 } };
+        state[0] = 1;
+        while(!stack.empty())
+        {
+            int n = stack.back().first;
+            size_t& e = stack.back().second;
+            if(e == nodes[n].edges.size())
+            {
+                state[n] = 2;
+                stack.pop_back();
+                continue;
+            }
+            int to = nodes[n].edges[e++].to;
+            if(to == EXIT)
+            {
+                continue;
+            }
+            preds[to].push_back(n);
+            if(state[to] == 1)
+            {
+                latches[to].push_back(n);
+            }
+            else if(state[to] == 0)
+            {
+                state[to] = 1;
+                stack.push_back({ to, 0 });
+            }
+        }
+        std::vector<std::pair<int, std::vector<bool> > > bodies;
+        for(size_t h = 0; h < count; h++)
+        {
+            if(latches[h].empty())
+            {
+                continue;
+            }
+            std::vector<bool> body(count);
+            body[h] = true;
+            std::vector<int> work(latches[h]);
+            while(!work.empty())
+            {
+                int n = work.back();
+                work.pop_back();
+                if(!body[n])
+                {
+                    body[n] = true;
+                    work.insert(work.end(), preds[n].begin(), preds[n].end());
+                }
+            }
+            bodies.push_back({ (int) h, body });
+        }
+        std::sort(bodies.begin(), bodies.end(), [](const std::pair<int, std::vector<bool> >& a, const std::pair<int, std::vector<bool> >& b)
+        {
+            return std::count(a.second.begin(), a.second.end(), true) < std::count(b.second.begin(), b.second.end(), true);
+        });
+
+        // Collapse the loops innermost first into single nodes costing the
+        // whole loop, left by the exits of the loop.
+        std::vector<int> parent(count);
+        for(size_t n = 0; n < count; n++)
+        {
+            parent[n] = n;
+        }
+        std::vector<uint64_t> dist(count);
+        for(const auto& loop : bodies)
+        {
+            int h = loop.first;
+            auto bound = bounds.find(nodes[h].addr);
+            if(bound == bounds.end() || bound->second == 0)
+            {
+                return Fail("loop at $%04X needs a bound", nodes[h].addr);
+            }
+            std::vector<bool> region(count);
+            for(size_t n = 0; n < count; n++)
+            {
+                if(loop.second[n])
+                {
+                    region[Find(parent, n)] = true;
+                }
+            }
+            std::vector<int> order;
+            if(!Order(nodes, parent, region, h, h, order))
+            {
+                return false;
+            }
+            uint64_t iteration = 0;
+            uint64_t exit = 0;
+            bool exits = false;
+            std::vector<Edge> exitEdges;
+            for(int n : order)
+            {
+                dist[n] = n == h ? nodes[h].cost : dist[n];
+            }
+            for(int n : order)
+            {
+                if(n != h)
+                {
+                    dist[n] += nodes[n].cost;
+                }
+                for(const Edge& e : nodes[n].edges)
+                {
+                    int to = e.to == EXIT ? EXIT : Find(parent, e.to);
+                    uint64_t total = dist[n] + e.cycles;
+                    if(to == h)
+                    {
+                        iteration = std::max(iteration, total);
+                    }
+                    else if(to == EXIT || !region[to])
+                    {
+                        exit = std::max(exit, total);
+                        exits = true;
+                        exitEdges.push_back({ e.to, 0 });
+                    }
+                    else
+                    {
+                        dist[to] = std::max(dist[to], total);
+                    }
+                }
+            }
+            for(int n : order)
+            {
+                dist[n] = 0;
+            }
+            if(!exits)
+            {
+                return Fail("loop at $%04X never exits", nodes[h].addr);
+            }
+            uint64_t total = (bound->second - 1) * iteration + exit;
+            loops.push_back({ entry, nodes[h].addr, bound->second, iteration, total });
+            for(size_t n = 0; n < count; n++)
+            {
+                if(region[n])
+                {
+                    parent[n] = h;
+                }
+            }
+            nodes[h].cost = total;
+            nodes[h].edges = exitEdges;
+        }
+
+        // What is left is acyclic, so take the longest path to an exit.
+        std::vector<bool> region(count);
+        for(size_t n = 0; n < count; n++)
+        {
+            region[Find(parent, n)] = true;
+        }
+        std::vector<int> order;
+        int first = Find(parent, 0);
+        if(!Order(nodes, parent, region, first, -2, order))
+        {
+            return false;
+        }
+        bool exits = false;
+        cycles = 0;
+        for(int n : order)
+        {
+            dist[n] += nodes[n].cost;
+            for(const Edge& e : nodes[n].edges)
+            {
+                uint64_t total = dist[n] + e.cycles;
+                if(e.to == EXIT)
+                {
+                    cycles = std::max(cycles, total);
+                    exits = true;
+                }
+                else
+                {
+                    int to = Find(parent, e.to);
+                    dist[to] = std::max(dist[to], total);
+                }
+            }
+        }
+        if(!exits)
+        {
+            return Fail("no return from $%04X", entry);
+        }
+        return true;
+    }
+};
+
+// Names of the Op_ handlers and addressing modes, for generated code and
+// reports. Handlers that branch, jump or stop are not called by translations,
+// which handle them some other way or leave them to the interpreter.
+template<CpuModel Model>
+struct HandlerNames
+{
+	typedef mos6502<Model> Cpu;
+	typedef typename Cpu::CodeExec CodeExec;
+	typedef typename Cpu::AddrExec AddrExec;
+	struct Handler
+	{
+		CodeExec code;
+		std::string name;
+		bool translated;
+	};
+
+	std::vector<Handler> handlers;
+	std::vector<std::pair<AddrExec, const char*> > modes;
+
+    HandlerNames()
+    {
+#define HANDLER_NAME(name) handlers.push_back({ &Cpu::name, #name, true })
+#define CONTROL_NAME(name) handlers.push_back({ &Cpu::name, #name, false })
+#define MODE_NAME(name) modes.push_back({ &Cpu::name, #name + 5 })
+        HANDLER_NAME(Op_ADC); HANDLER_NAME(Op_ALR); HANDLER_NAME(Op_ANC); HANDLER_NAME(Op_AND); HANDLER_NAME(Op_ARR);
+        HANDLER_NAME(Op_ASL); HANDLER_NAME(Op_ASL_ACC); HANDLER_NAME(Op_BIT); HANDLER_NAME(Op_BIT_IMM);
+        HANDLER_NAME(Op_CLC); HANDLER_NAME(Op_CLD); HANDLER_NAME(Op_CLI); HANDLER_NAME(Op_CLV); HANDLER_NAME(Op_CMP);
+        HANDLER_NAME(Op_CPX); HANDLER_NAME(Op_CPY); HANDLER_NAME(Op_DCP); HANDLER_NAME(Op_DEC);
+        HANDLER_NAME(Op_DEC_ACC); HANDLER_NAME(Op_DEX); HANDLER_NAME(Op_DEY); HANDLER_NAME(Op_EOR);
+        HANDLER_NAME(Op_INC); HANDLER_NAME(Op_INC_ACC); HANDLER_NAME(Op_INX); HANDLER_NAME(Op_INY);
+        HANDLER_NAME(Op_ISC); HANDLER_NAME(Op_JSR); HANDLER_NAME(Op_LAX); HANDLER_NAME(Op_LDA); HANDLER_NAME(Op_LDX);
+        HANDLER_NAME(Op_LDY); HANDLER_NAME(Op_LSR); HANDLER_NAME(Op_LSR_ACC); HANDLER_NAME(Op_NOP);
+        HANDLER_NAME(Op_ORA); HANDLER_NAME(Op_PHA); HANDLER_NAME(Op_PHP); HANDLER_NAME(Op_PHX); HANDLER_NAME(Op_PHY);
+        HANDLER_NAME(Op_PLA); HANDLER_NAME(Op_PLP); HANDLER_NAME(Op_PLX); HANDLER_NAME(Op_PLY); HANDLER_NAME(Op_RLA);
+        HANDLER_NAME(Op_ROL); HANDLER_NAME(Op_ROL_ACC); HANDLER_NAME(Op_ROR); HANDLER_NAME(Op_ROR_ACC);
+        HANDLER_NAME(Op_RRA); HANDLER_NAME(Op_RTI); HANDLER_NAME(Op_RTS); HANDLER_NAME(Op_RTS_EXIT);
+        HANDLER_NAME(Op_SAX); HANDLER_NAME(Op_SBC); HANDLER_NAME(Op_SBX); HANDLER_NAME(Op_SEC); HANDLER_NAME(Op_SED);
+        HANDLER_NAME(Op_SEI); HANDLER_NAME(Op_SLO); HANDLER_NAME(Op_SRE); HANDLER_NAME(Op_STA); HANDLER_NAME(Op_STX);
+        HANDLER_NAME(Op_STY); HANDLER_NAME(Op_STZ); HANDLER_NAME(Op_TAX); HANDLER_NAME(Op_TAY); HANDLER_NAME(Op_TRB);
+        HANDLER_NAME(Op_TSB); HANDLER_NAME(Op_TSX); HANDLER_NAME(Op_TXA); HANDLER_NAME(Op_TXS); HANDLER_NAME(Op_TYA);
+        CONTROL_NAME(Op_BCC); CONTROL_NAME(Op_BCS); CONTROL_NAME(Op_BEQ); CONTROL_NAME(Op_BMI); CONTROL_NAME(Op_BNE);
+        CONTROL_NAME(Op_BPL); CONTROL_NAME(Op_BRA); CONTROL_NAME(Op_BRK); CONTROL_NAME(Op_BRK_EXIT);
+        CONTROL_NAME(Op_BVC); CONTROL_NAME(Op_BVS); CONTROL_NAME(Op_ILLEGAL); CONTROL_NAME(Op_JMP);
+        CONTROL_NAME(Op_STP); CONTROL_NAME(Op_TRAP); CONTROL_NAME(Op_WAI);
+        MODE_NAME(Addr_ACC); MODE_NAME(Addr_IMM); MODE_NAME(Addr_ABS); MODE_NAME(Addr_ZER); MODE_NAME(Addr_IMP);
+        MODE_NAME(Addr_REL); MODE_NAME(Addr_ABI); MODE_NAME(Addr_ZEX); MODE_NAME(Addr_ZEY); MODE_NAME(Addr_ABX);
+        MODE_NAME(Addr_ABY); MODE_NAME(Addr_INX); MODE_NAME(Addr_INY); MODE_NAME(Addr_ABX_P); MODE_NAME(Addr_ABY_P);
+        MODE_NAME(Addr_INY_P); MODE_NAME(Addr_ZPI); MODE_NAME(Addr_AIX);
+#undef HANDLER_NAME
+#undef CONTROL_NAME
+#undef MODE_NAME
+        AddBitNames<0>();
+    }
+
+    template<int bit>
+    void AddBitNames()
+    {
+        handlers.push_back({ &Cpu::template Op_RMB<bit>, "Op_RMB<" + std::to_string(bit) + ">", true });
+        handlers.push_back({ &Cpu::template Op_SMB<bit>, "Op_SMB<" + std::to_string(bit) + ">", true });
+        handlers.push_back({ &Cpu::template Op_BBR<bit>, "Op_BBR<" + std::to_string(bit) + ">", false });
+        handlers.push_back({ &Cpu::template Op_BBS<bit>, "Op_BBS<" + std::to_string(bit) + ">", false });
+        if(bit < 7)
+        {
+            AddBitNames<bit < 7 ? bit + 1 : 7>();
+        }
+    }
+
+    const Handler* Find(CodeExec code) const
+    {
+        for(const Handler& h : handlers)
+        {
+            if(h.code == code)
+            {
+                return &h;
+            }
+        }
+        return NULL;
+    }
+
+    const char* Op(CodeExec code) const
+    {
+        const Handler* h = Find(code);
+        return h ? h->name.c_str() : "?";
+    }
+
+    const char* Mode(AddrExec addr) const
+    {
+        for(const auto& m : modes)
+        {
+            if(m.first == addr)
+            {
+                return m.second;
+            }
+        }
+        return "?";
+    }
+};
+
+// Translates the code reachable from a set of entry points into C++ with a
+// label per basic block and direct gotos between them. Instructions call the
+// same Op_ handlers as the interpreter, so flags and memory behave the same.
+// Computed jumps, BRK, STP, WAI, loops that wait on themselves and code pages
+// written since they were translated are left to the interpreter.
+template<CpuModel Model>
+struct Recompiler
+{
+	typedef mos6502<Model> Cpu;
+	typedef typename Cpu::Instr Instr;
+	typedef typename Cpu::CodeExec CodeExec;
+	enum Kind { PLAIN, BRANCH, JUMP, CALL, RETURN, INTERPRET };
+
+	Cpu& cpu;
+	HandlerNames<Model> names;
+	std::vector<bool> visited;
+	std::vector<bool> leader;
+
+    Recompiler(Cpu& cpu) : cpu(cpu), visited(65536), leader(65536)
+    {
+    }
+
+    // The handler translations call for an instruction, or NULL if it is
+    // translated some other way or interpreted.
+    const char* Name(CodeExec code)
+    {
+        const auto* handler = names.Find(code);
+        return handler && handler->translated ? handler->name.c_str() : NULL;
+    }
+
+    bool IsBit(uint8_t opcode)
+    {
+        return Cpu::rockwell && (opcode & 0x0F) == 0x0F;
+    }
+
+    // Whether reaching addr stops the CPU, through an exit or breakpoint that
+    // only the interpreter's fetch sees.
+    bool Stops(uint16_t addr)
+    {
+        for(uint16_t exit : cpu.exitPcs)
+        {
+            if(exit == addr)
+            {
+                return true;
+            }
+        }
+        for(const auto& b : cpu.breakpoints)
+        {
+            if(b.addr == addr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Kind Classify(uint16_t addr, uint16_t& target)
+    {
+        if(Stops(addr))
+        {
+            return INTERPRET;
+        }
+        uint8_t opcode = cpu.Peek(addr);
+        const Instr& instr = cpu.InstrTable[opcode];
+        uint16_t next = addr + cpu.InstrLength(opcode);
+        if(instr.addr == &Cpu::Addr_REL || IsBit(opcode))
+        {
+            target = next + (int8_t) cpu.Peek(addr + (IsBit(opcode) ? 2 : 1));
+            return instr.code == &Cpu::Op_BRA ? JUMP : BRANCH;
+        }
+        target = cpu.Peek(addr + 1) | (cpu.Peek(addr + 2) << 8);
+        if(instr.code == &Cpu::Op_JMP)
+        {
+            return instr.addr == &Cpu::Addr_ABS ? JUMP : INTERPRET;
+        }
+        if(instr.code == &Cpu::Op_JSR)
+        {
+            return CALL;
+        }
+        if(instr.code == &Cpu::Op_RTS || instr.code == &Cpu::Op_RTS_EXIT || instr.code == &Cpu::Op_RTI)
+        {
+            return RETURN;
+        }
+        return Name(instr.code) ? PLAIN : INTERPRET;
+    }
+
+    // Whether an interpreted instruction carries on with the next one.
+    bool Resumes(uint16_t addr)
+    {
+        CodeExec code = cpu.InstrTable[cpu.Peek(addr)].code;
+        return code != &Cpu::Op_JMP && code != &Cpu::Op_BRK && code != &Cpu::Op_BRK_EXIT
+            && code != &Cpu::Op_STP && code != &Cpu::Op_ILLEGAL;
+    }
+
+    // Marks the reachable instructions and the block leaders among them.
+    void Discover(const std::vector<uint16_t>& entries)
+    {
+        std::vector<uint16_t> work(entries);
+        for(uint16_t entry : entries)
+        {
+            leader[entry] = true;
+        }
+        while(!work.empty())
+        {
+            uint16_t addr = work.back();
+            work.pop_back();
+            if(visited[addr])
+            {
+                continue;
+            }
+            visited[addr] = true;
+            uint16_t target;
+            uint16_t next = addr + cpu.InstrLength(cpu.Peek(addr));
+            Kind kind = Classify(addr, target);
+            if(kind == BRANCH || kind == JUMP || kind == CALL)
+            {
+                leader[target] = true;
+                work.push_back(target);
+            }
+            if(kind == BRANCH || kind == CALL || kind == PLAIN || (kind == INTERPRET && Resumes(addr)))
+            {
+                if(kind != PLAIN)
+                {
+                    leader[next] = true;
+                }
+                work.push_back(next);
+            }
+        }
+        // Emitted code falls through to the next instruction in address
+        // order. Where that is not the one that follows, as when a BIT abs
+        // skips over an instruction hidden in its operand, it gets a label.
+        int previous = -1;
+        for(int addr = 0; addr <= 65536; addr++)
+        {
+            if(addr < 65536 && !visited[addr])
+            {
+                continue;
+            }
+            if(previous >= 0)
+            {
+                uint16_t target;
+                uint16_t next = previous + cpu.InstrLength(cpu.Peek(previous));
+                Kind kind = Classify(previous, target);
+                bool falls = kind == BRANCH || kind == PLAIN;
+                if(falls && visited[next] && next != addr)
+                {
+                    leader[next] = true;
+                }
+            }
+            previous = addr;
+        }
+    }
+
+    // The address an instruction operates on, as a C++ expression.
+    std::string Operand(uint16_t addr, const Instr& instr)
+    {
+        char text[160];
+        uint8_t lo = cpu.Peek(addr + 1);
+        uint16_t word = lo | (cpu.Peek(addr + 2) << 8);
+        typename Cpu::AddrExec a = instr.addr;
+        if(a == &Cpu::Addr_IMP || a == &Cpu::Addr_ACC) snprintf(text, sizeof(text), "0");
+        else if(a == &Cpu::Addr_IMM) snprintf(text, sizeof(text), "0x%04X", (uint16_t) (addr + 1));
+        else if(a == &Cpu::Addr_ZER) snprintf(text, sizeof(text), "0x%02X", lo);
+        else if(a == &Cpu::Addr_ABS) snprintf(text, sizeof(text), "0x%04X", word);
+        else if(a == &Cpu::Addr_ZEX) snprintf(text, sizeof(text), "(uint8_t) (0x%02X + cpu.X)", lo);
+        else if(a == &Cpu::Addr_ZEY) snprintf(text, sizeof(text), "(uint8_t) (0x%02X + cpu.Y)", lo);
+        else if(a == &Cpu::Addr_ABX || a == &Cpu::Addr_ABX_P) snprintf(text, sizeof(text), "(uint16_t) (0x%04X + cpu.X)", word);
+        else if(a == &Cpu::Addr_ABY || a == &Cpu::Addr_ABY_P) snprintf(text, sizeof(text), "(uint16_t) (0x%04X + cpu.Y)", word);
+        else if(a == &Cpu::Addr_INX) snprintf(text, sizeof(text),
+            "cpu.Read((uint8_t) (0x%02X + cpu.X)) | cpu.Read((uint8_t) (0x%02X + cpu.X)) << 8", lo, (uint8_t) (lo + 1));
+        else if(a == &Cpu::Addr_INY || a == &Cpu::Addr_INY_P) snprintf(text, sizeof(text),
+            "(uint16_t) ((cpu.Read(0x%02X) | cpu.Read(0x%02X) << 8) + cpu.Y)", lo, (uint8_t) (lo + 1));
+        else if(a == &Cpu::Addr_ZPI) snprintf(text, sizeof(text), "cpu.Read(0x%02X) | cpu.Read(0x%02X) << 8", lo, (uint8_t) (lo + 1));
+        else return "";
+        return text;
+    }
+
+    // Page crossing penalty of an indexed read, as a C++ expression.
+    std::string Penalty(uint16_t addr, const Instr& instr)
+    {
+        char text[96];
+        uint8_t lo = cpu.Peek(addr + 1);
+        if(instr.addr == &Cpu::Addr_ABX_P) snprintf(text, sizeof(text), "(0x%02X + cpu.X) >> 8", cpu.Peek(addr + 1));
+        else if(instr.addr == &Cpu::Addr_ABY_P) snprintf(text, sizeof(text), "(0x%02X + cpu.Y) >> 8", cpu.Peek(addr + 1));
+        else if(instr.addr == &Cpu::Addr_INY_P) snprintf(text, sizeof(text), "(cpu.Read(0x%02X) + cpu.Y) >> 8", lo);
+        else return "";
+        return text;
+    }
+
+    std::string Condition(uint8_t opcode, uint16_t addr)
+    {
+        char text[64];
+        if(IsBit(opcode))
+        {
+            snprintf(text, sizeof(text), "%s(cpu.Read(0x%02X) & 0x%02X)", opcode & 0x80 ? "" : "!", cpu.Peek(addr + 1), 1 << ((opcode >> 4) & 7));
+            return text;
+        }
+        static const char* flags[] = { "NEGATIVE", "OVERFLOW", "CARRY", "ZERO" };
+        snprintf(text, sizeof(text), "%s(cpu.status & %s)", opcode & 0x20 ? "" : "!", flags[opcode >> 6]);
+        return text;
+    }
+
+    // Writes the translation to out. Returns the number of instructions.
+    size_t Emit(FILE* out, const char* model, const char* image)
+    {
+        std::vector<uint16_t> starts;
+        std::vector<bool> pages(256);
+        size_t count = 0;
+        for(int addr = 0; addr < 65536; addr++)
+        {
+            if(visited[addr])
+            {
+                int length = cpu.InstrLength(cpu.Peek(addr));
+                for(int i = 0; i < length; i++)
+                {
+                    pages[((addr + i) >> 8) & 0xFF] = true;
+                }
+                if(leader[addr])
+                {
+                    starts.push_back(addr);
+                }
+                count++;
+            }
+        }
+        fprintf(out, "// Recompiled from %s by run6502 -aot. Build it next to main.cpp:\n", image);
+        fprintf(out, "//     g++ -O2 this.cpp -o emu -pthread -ldl\n");
+        fprintf(out, "#define RUN6502_RECOMPILED %s\n#include \"main.cpp\"\n\n", model);
+        fprintf(out, "typedef mos6502<RUN6502_RECOMPILED> Cpu;\n\n");
+        fprintf(out, "// Whether the translated bytes of a page still hold what was translated.\n");
+        fprintf(out, "static bool Unchanged(Cpu& cpu, int page)\n{\n    const uint8_t* m = cpu.ramPage[page];\n    switch(page)\n    {\n");
+        for(int page = 0; page < 256; page++)
+        {
+            if(!pages[page])
+            {
+                continue;
+            }
+            fprintf(out, "    case 0x%02X:\n        return m", page);
+            for(int addr = page << 8; addr < (page + 1) << 8;)
+            {
+                int end = addr;
+                while(end < (page + 1) << 8 && Translated(end))
+                {
+                    end++;
+                }
+                if(end > addr)
+                {
+                    fprintf(out, "\n            && memcmp(m + 0x%02X, \"", addr & 0xFF);
+                    for(int i = addr; i < end; i++)
+                    {
+                        fprintf(out, "\\x%02X", cpu.Peek(i));
+                    }
+                    fprintf(out, "\", %d) == 0", end - addr);
+                }
+                addr = end + 1;
+            }
+            fprintf(out, ";\n");
+        }
+        fprintf(out, "    }\n    return false;\n}\n\n");
+        fprintf(out, "// Mixed pages stay with the interpreter once they are found.\n");
+        fprintf(out, "static bool Rearm(Cpu& cpu, int page)\n{\n    if(cpu.Mixed(page) || !Unchanged(cpu, page))\n    {\n        return false;\n    }\n");
+        fprintf(out, "    cpu.ArmTrap(page << 8, Cpu::TRAP_CODE);\n    return true;\n}\n\n");
+        fprintf(out, "static void RecompiledSetup(Cpu& cpu)\n{\n");
+        for(int page = 0; page < 256; page++)
+        {
+            if(pages[page])
+            {
+                fprintf(out, "    Rearm(cpu, 0x%02X);\n", page);
+            }
+        }
+        fprintf(out, "}\n\nstatic void Recompiled(Cpu& cpu)\n{\ndispatch:\n    switch(cpu.pc)\n    {\n");
+        for(uint16_t start : starts)
+        {
+            fprintf(out, "    case 0x%04X: goto L%04X;\n", start, start);
+        }
+        fprintf(out, "    }\n    return;\n");
+        for(int addr = 0; addr < 65536; addr++)
+        {
+            if(!visited[addr])
+            {
+                continue;
+            }
+            uint8_t opcode = cpu.Peek(addr);
+            int length = cpu.InstrLength(opcode);
+            uint16_t next = addr + length;
+            const Instr& instr = cpu.InstrTable[opcode];
+            std::string written;
+            for(int page = next >> 8; visited[next] && MayWriteCode(addr, instr, pages) && !leader[next] && page <= ((next + 2) >> 8) && page < 256; page++)
+            {
+                char check[64];
+                snprintf(check, sizeof(check), " || !(cpu.pageTraps[0x%02X] & Cpu::TRAP_CODE)", page);
+                written += check;
+            }
+            if(leader[addr])
+            {
+                fprintf(out, "L%04X:\n    if(cpu.cycleCount >= cpu.nextEvent", addr);
+                for(int page = addr >> 8; page <= ((addr + length - 1) >> 8) && page < 256; page++)
+                {
+                    fprintf(out, " || (!(cpu.pageTraps[0x%02X] & Cpu::TRAP_CODE) && !Rearm(cpu, 0x%02X))", page, page);
+                }
+                fprintf(out, ")\n    {\n        cpu.pc = 0x%04X;\n        return;\n    }\n", addr);
+            }
+            fprintf(out, "    // $%04X:", addr);
+            for(int i = 0; i < length; i++)
+            {
+                fprintf(out, " %02X", cpu.Peek(addr + i));
+            }
+            fprintf(out, "\n");
+            uint16_t target;
+            Kind kind = Classify(addr, target);
+            if(kind == INTERPRET || ((kind == BRANCH || kind == JUMP) && target == addr))
+            {
+                // Loops on themselves go to the interpreter too, which idles them.
+                if(kind == BRANCH)
+                {
+                    fprintf(out, "    if(%s)\n    {\n        cpu.pc = 0x%04X;\n        return;\n    }\n", Condition(opcode, addr).c_str(), addr);
+                    fprintf(out, "    cpu.cycleCount += %d;\n", instr.cycles);
+                }
+                else
+                {
+                    fprintf(out, "    cpu.pc = 0x%04X;\n    return;\n", addr);
+                    continue;
+                }
+            }
+            else if(kind == BRANCH)
+            {
+                fprintf(out, "    cpu.cycleCount += %d;\n", instr.cycles);
+                fprintf(out, "    if(%s)\n    {\n        cpu.cycleCount += %d;\n        goto L%04X;\n    }\n",
+                    Condition(opcode, addr).c_str(), (target ^ next) & 0xFF00 ? 2 : 1, target);
+            }
+            else if(kind == JUMP)
+            {
+                fprintf(out, "    cpu.cycleCount += %d;\n    goto L%04X;\n", instr.cycles + (instr.code == &Cpu::Op_BRA ? ((target ^ next) & 0xFF00 ? 2 : 1) : 0), target);
+                continue;
+            }
+            else if(kind == CALL)
+            {
+                fprintf(out, "    cpu.opPc = 0x%04X;\n    cpu.pc = 0x%04X;\n    cpu.Op_JSR(0x%04X);\n    cpu.cycleCount += %d;\n", addr, next, target, instr.cycles);
+                fprintf(out, "    if(cpu.stopReason != STOP_NONE)\n    {\n        return;\n    }\n    goto L%04X;\n", target);
+                continue;
+            }
+            else if(kind == RETURN)
+            {
+                fprintf(out, "    cpu.opPc = 0x%04X;\n    cpu.pc = 0x%04X;\n    cpu.%s(0);\n    cpu.cycleCount += %d;\n", addr, next, Name(instr.code), instr.cycles);
+                fprintf(out, "    if(cpu.stopReason != STOP_NONE)\n    {\n        return;\n    }\n    goto dispatch;\n");
+                continue;
+            }
+            else
+            {
+                const char* name = Name(instr.code);
+                bool memory = instr.addr != &Cpu::Addr_IMP && instr.addr != &Cpu::Addr_ACC && instr.addr != &Cpu::Addr_IMM;
+                if(memory || strncmp(name, "Op_P", 4) == 0)
+                {
+                    fprintf(out, "    cpu.opPc = 0x%04X;\n", addr);
+                }
+                fprintf(out, "    cpu.%s(%s);\n    cpu.cycleCount += %d;\n", name, Operand(addr, instr).c_str(), instr.cycles);
+                std::string penalty = Penalty(addr, instr);
+                if(penalty.size())
+                {
+                    fprintf(out, "    cpu.cycleCount += %s;\n", penalty.c_str());
+                }
+                if(instr.code == &Cpu::Op_ADC || instr.code == &Cpu::Op_SBC)
+                {
+                    fprintf(out, "    cpu.cycleCount += cpu.extraCycles;\n    cpu.extraCycles = 0;\n");
+                }
+                if(memory)
+                {
+                    // A stop, or a write to code still ahead, ends native execution.
+                    fprintf(out, "    if(cpu.stopReason != STOP_NONE%s)\n    {\n        cpu.pc = 0x%04X;\n        return;\n    }\n", written.c_str(), next);
+                }
+                if(instr.code == &Cpu::Op_CLI || instr.code == &Cpu::Op_PLP)
+                {
+                    fprintf(out, "    if(cpu.nextEvent == 0)\n    {\n        cpu.pc = 0x%04X;\n        return;\n    }\n", next);
+                }
+            }
+            if(visited[next] && leader[next])
+            {
+                fprintf(out, "    goto L%04X;\n", next);
+            }
+            else if(!visited[next])
+            {
+                fprintf(out, "    cpu.pc = 0x%04X;\n    return;\n", next);
+            }
+        }
+        fprintf(out, "}\n\nextern \"C\" void run6502_recompiled_setup(void* cpu)\n{\n    RecompiledSetup(*(Cpu*) cpu);\n}\n\n");
+        fprintf(out, "extern \"C\" void run6502_recompiled(void* cpu)\n{\n    Recompiled(*(Cpu*) cpu);\n}\n\n");
+        fprintf(out, "extern \"C\" size_t run6502_recompiled_layout()\n{\n    return sizeof(Cpu);\n}\n");
+        return count;
+    }
+
+    // Whether an instruction may store to a translated page. Loads and stores
+    // to pages that hold only data skip the invalidation check.
+    bool MayWriteCode(uint16_t addr, const Instr& instr, const std::vector<bool>& pages)
+    {
+        static const CodeExec loads[] = {
+            &Cpu::Op_ADC, &Cpu::Op_AND, &Cpu::Op_BIT, &Cpu::Op_CMP, &Cpu::Op_CPX, &Cpu::Op_CPY, &Cpu::Op_EOR,
+            &Cpu::Op_LAX, &Cpu::Op_LDA, &Cpu::Op_LDX, &Cpu::Op_LDY, &Cpu::Op_NOP, &Cpu::Op_ORA, &Cpu::Op_SBC
+        };
+        for(CodeExec load : loads)
+        {
+            if(instr.code == load)
+            {
+                return false;
+            }
+        }
+        int page = cpu.Peek(addr + 2);
+        typename Cpu::AddrExec a = instr.addr;
+        if(a == &Cpu::Addr_ZER || a == &Cpu::Addr_ZEX || a == &Cpu::Addr_ZEY)
+        {
+            return pages[0];
+        }
+        if(a == &Cpu::Addr_ABS)
+        {
+            return pages[page];
+        }
+        if(a == &Cpu::Addr_ABX || a == &Cpu::Addr_ABX_P || a == &Cpu::Addr_ABY || a == &Cpu::Addr_ABY_P)
+        {
+            return pages[page] || pages[(page + 1) & 0xFF];
+        }
+        return true;
+    }
+
+    bool Translated(int addr)
+    {
+        for(int back = 0; back < 3 && addr - back >= 0; back++)
+        {
+            if(visited[addr - back] && cpu.InstrLength(cpu.Peek(addr - back)) > back)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Machines for very large batches: their 16 byte states packed side by
+// side, the cycles their next interrupts are due at, and their memory, all
+// in one arena. Any number of engines, one per thread, run the machines in
+// turn through Run. Memory is either the low
+// pages of the image copied for each machine, with the pages past them
+// mapped as they were in the engine and so shared by every machine, or
+// sparse memory sharing the whole image until written.
+struct MachinePool
+{
+	struct Schedule
+	{
+		uint64_t irqAt;
+		uint64_t nmiAt;
+	};
+    Arena arena;
+    size_t count = 0;
+    int pages = 0;
+    CpuState* states = NULL;
+    Schedule* schedules = NULL;
+    std::vector<uint8_t*> memory;
+    SparseMemory* sparse = NULL;
+    SharedImage image;
+
+    // Starts count machines from the same state, interrupt schedule and low
+    // pages of image. Returns false when the arena runs out of address space.
+    bool Create(size_t count, int pages, const uint8_t* image, const CpuState& initial, const Schedule& schedule)
+    {
+        this->count = count;
+        this->pages = pages;
+        memory.resize(count);
+        states = (CpuState*) arena.Allocate(count * sizeof(CpuState));
+        schedules = (Schedule*) arena.Allocate(count * sizeof(Schedule));
+        for(size_t i = 0; i < count; i++)
+        {
+            memory[i] = (uint8_t*) arena.Allocate(pages * 256, 256);
+            if(!states || !schedules || !memory[i])
+            {
+                return false;
+            }
+            memcpy(memory[i], image, pages * 256);
+            states[i] = initial;
+            schedules[i] = schedule;
+        }
+        return true;
+    }
+
+    // Starts count machines from the same state and interrupt schedule,
+    // sharing the 64K image.
+    bool CreateSparse(size_t count, uint8_t* image, const CpuState& initial, const Schedule& schedule)
+    {
+        this->count = count;
+        states = (CpuState*) arena.Allocate(count * sizeof(CpuState));
+        schedules = (Schedule*) arena.Allocate(count * sizeof(Schedule));
+        sparse = (SparseMemory*) arena.Allocate(count * sizeof(SparseMemory));
+        if(!states || !schedules || !sparse)
+        {
+            return false;
+        }
+        this->image.Share(image);
+        for(size_t i = 0; i < count; i++)
+        {
+            sparse[i].Share(this->image, arena);
+            states[i] = initial;
+            schedules[i] = schedule;
+        }
+        return true;
+    }
+
+    template<CpuModel Model>
+    StopReason Run(mos6502<Model>& engine, size_t machine, int64_t cycles)
+    {
+        if(sparse)
+        {
+            engine.MapSparse(&sparse[machine]);
+        }
+        else
+        {
+            engine.MapRam(memory[machine], 0, pages);
+        }
+        engine.Load(states[machine]);
+        engine.irqAt = schedules[machine].irqAt;
+        engine.nmiAt = schedules[machine].nmiAt;
+        StopReason reason = engine.Run(cycles);
+        engine.Save(states[machine]);
+        schedules[machine].irqAt = engine.irqAt;
+        schedules[machine].nmiAt = engine.nmiAt;
+        return reason;
+    }
+};
+
+// A history of checkpoints taken as a run goes along. Each holds the CPU
+// state and the RAM pages written since the checkpoint before, XORed with
+// what they held then and run-length coded, so that unchanged bytes cost
+// next to nothing. Every keyframeEvery-th checkpoint holds all RAM pages
+// instead, which bounds the deltas a restore has to replay.
+template<CpuModel Model>
+struct CheckpointHistory
+{
+	typedef mos6502<Model> Cpu;
+	struct Checkpoint
+	{
+		CpuState cpu;
+		uint64_t irqAt;
+		uint64_t nmiAt;
+		bool keyframe;
+		std::vector<uint8_t> data;
+	};
+
+	Cpu& cpu;
+	int keyframeEvery;
+	std::vector<Checkpoint> checkpoints;
+
+	// RAM as of the last checkpoint, for the deltas.
+	std::vector<uint8_t> shadow;
+
+    CheckpointHistory(Cpu& cpu, int keyframeEvery) : cpu(cpu), keyframeEvery(keyframeEvery), shadow(65536)
+    {
+    }
+
+    void Take()
+    {
+        Checkpoint c;
+        cpu.Save(c.cpu);
+        c.irqAt = cpu.irqAt;
+        c.nmiAt = cpu.nmiAt;
+        c.keyframe = checkpoints.size() % keyframeEvery == 0;
+        bool dirty[256] = {};
+        for(uint8_t page : cpu.dirtyPages)
+        {
+            dirty[page] = true;
+        }
+        for(int page = 0; page < 256; page++)
+        {
+            if(!cpu.ramPage[page] || !(c.keyframe || dirty[page]))
+            {
+                continue;
+            }
+            const uint8_t* ram = cpu.ramPage[page];
+            uint8_t* old = shadow.data() + page * 256;
+            uint8_t delta[256];
+            for(int i = 0; i < 256; i++)
+            {
+                delta[i] = c.keyframe ? ram[i] : ram[i] ^ old[i];
+            }
+            c.data.push_back(page);
+            RleEncode(delta, 256, c.data);
+            memcpy(old, ram, 256);
+        }
+        c.data.shrink_to_fit();
+        checkpoints.push_back(std::move(c));
+        cpu.TrackDirtyPages();
+    }
+
+    // Rebuilds the RAM pages and CPU state of a checkpoint from the keyframe
+    // at or before it and the deltas since.
+    void Reconstruct(size_t index, uint8_t* image, CpuState& state) const
+    {
+        size_t key = index;
+        while(!checkpoints[key].keyframe)
+        {
+            key--;
+        }
+        for(size_t i = key; i <= index; i++)
+        {
+            const Checkpoint& c = checkpoints[i];
+            const uint8_t* p = c.data.data();
+            while(p < c.data.data() + c.data.size())
+            {
+                uint8_t* page = image + *p++ * 256;
+                uint8_t delta[256];
+                p = RleDecode(p, delta, 256);
+                for(int j = 0; j < 256; j++)
+                {
+                    page[j] = c.keyframe ? delta[j] : page[j] ^ delta[j];
+                }
+            }
+        }
+        state = checkpoints[index].cpu;
+    }
+
+    // Puts the CPU back to a checkpoint and forgets those after it.
+    void Rewind(size_t index)
+    {
+        CpuState state;
+        Reconstruct(index, shadow.data(), state);
+        for(int page = 0; page < 256; page++)
+        {
+            if(cpu.ramPage[page])
+            {
+                memcpy(cpu.ramPage[page], shadow.data() + page * 256, 256);
+            }
+        }
+        cpu.Load(state);
+        cpu.irqAt = checkpoints[index].irqAt;
+        cpu.nmiAt = checkpoints[index].nmiAt;
+        checkpoints.resize(index + 1);
+        cpu.TrackDirtyPages();
+    }
+
+    size_t Bytes(size_t index) const
+    {
+        return sizeof(Checkpoint) + checkpoints[index].data.capacity();
+    }
+};
+
+// Live monitor: registers, cycle and instruction counts and chosen memory
+// ranges published into a POSIX shared memory segment for other processes
+// to watch. Updates are guarded by a seqlock. The writer makes sequence odd
+// while it writes, and readers retry while it is odd or has moved across
+// their copy, so neither side ever blocks the other.
+struct MonitorBlock
+{
+    static const uint32_t layoutVersion = 1;
+    static const int maxRanges = 16;
+    std::atomic<uint32_t> sequence;
+    uint32_t version;
+    uint32_t size;
+    uint32_t rangeCount;
+    uint64_t cycleCount;
+    uint64_t instructions;
+    uint16_t pc;
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t sp;
+    uint8_t status;
+    uint8_t running;
+    MemoryRange ranges[maxRanges];
+    uint8_t data[];
+};
+
+struct Monitor
+{
+    std::string name;
+    MonitorBlock* block = NULL;
+    size_t size = 0;
+
+    Monitor() = default;
+    Monitor(const Monitor&) = delete;
+    Monitor& operator=(const Monitor&) = delete;
+
+    ~Monitor()
+    {
+        if(block)
+        {
+            munmap(block, size);
+            shm_unlink(name.c_str());
+        }
+    }
+
+    // Creates the segment for up to MonitorBlock::maxRanges ranges. Returns
+    // false if it cannot.
+    bool Create(const char* name, const std::vector<MemoryRange>& ranges)
+    {
+        size_t bytes = 0;
+        for(const MemoryRange& r : ranges)
+        {
+            bytes += r.last - r.first + 1;
+        }
+        if(ranges.size() > (size_t) MonitorBlock::maxRanges)
+        {
+            return false;
+        }
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+        {
+            return false;
+        }
+        size = sizeof(MonitorBlock) + bytes;
+        void* map = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(map == MAP_FAILED)
+        {
+            shm_unlink(name);
+            return false;
+        }
+        this->name = name;
+        block = (MonitorBlock*) map;
+        block->version = MonitorBlock::layoutVersion;
+        block->size = size;
+        block->rangeCount = ranges.size();
+        std::copy(ranges.begin(), ranges.end(), block->ranges);
+        return true;
+    }
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_TSX;
-        instr.cycles = 2;
-        InstrTable[0xBA] = instr;
+    template<CpuModel Model>
+    void Publish(mos6502<Model>& cpu, uint64_t instructions, bool running = true)
+    {
+        uint32_t sequence = block->sequence.load(std::memory_order_relaxed);
+        block->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        block->cycleCount = cpu.cycleCount;
+        block->instructions = instructions;
+        block->pc = cpu.pc;
+        block->A = cpu.A;
+        block->X = cpu.X;
+        block->Y = cpu.Y;
+        block->sp = cpu.sp;
+        block->status = cpu.status;
+        block->running = running;
+        uint8_t* data = block->data;
+        for(uint32_t i = 0; i < block->rangeCount; i++)
+        {
+            for(uint32_t addr = block->ranges[i].first; addr <= block->ranges[i].last; addr++)
+            {
+                *data++ = cpu.Peek(addr);
+            }
+        }
+        block->sequence.store(sequence + 2, std::memory_order_release);
+    }
+};
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_TXA;
-        instr.cycles = 2;
-        InstrTable[0x8A] = instr;
+// Maps a monitor segment read only and takes consistent copies of it.
+struct MonitorReader
+{
+    const MonitorBlock* block = NULL;
+    size_t size = 0;
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_TXS;
-        instr.cycles = 2;
-        InstrTable[0x9A] = instr;
+    MonitorReader() = default;
+    MonitorReader(const MonitorReader&) = delete;
+    MonitorReader& operator=(const MonitorReader&) = delete;
 
-        instr.addr = &mos6502::Addr_IMP;
-        instr.code = &mos6502::Op_TYA;
-        instr.cycles = 2;
-        InstrTable[0x98] = instr;
+    ~MonitorReader()
+    {
+        if(block)
+        {
+            munmap((void*) block, size);
+        }
     }
 
-    uint16_t Addr_ACC()
+    bool Open(const char* name)
     {
-        return 0; // Not used.
+        int fd = shm_open(name, O_RDONLY, 0);
+        if(fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        void* map = fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(MonitorBlock)
+            ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(map == MAP_FAILED)
+        {
+            return false;
+        }
+        block = (const MonitorBlock*) map;
+        size = st.st_size;
+        if(block->version != MonitorBlock::layoutVersion || block->size != size)
+        {
+            munmap(map, size);
+            block = NULL;
+            return false;
+        }
+        return true;
     }
 
-    uint16_t Addr_IMM()
+    // Copies the block into copy, of size bytes, and returns its sequence.
+    uint32_t Read(MonitorBlock* copy) const
     {
-        return pc++;
+        for(;;)
+        {
+            uint32_t before = block->sequence.load(std::memory_order_acquire);
+            if(before & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            memcpy((uint8_t*) copy + sizeof(copy->sequence), (const uint8_t*) block + sizeof(block->sequence), size - sizeof(block->sequence));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(block->sequence.load(std::memory_order_relaxed) == before)
+            {
+                return before;
+            }
+        }
     }
+};
 
-    uint16_t Addr_ABS()
+// Runs N independent machines on one host thread, one instruction from each
+// in turn, so that the host core overlaps the dependent fetch and dispatch
+// loads of one machine with those of the others. Each machine ends as Run
+// with the same budget would have. Whatever the inner loop of Run would not
+// do, interrupts, waits and deadlines, goes through Run one instruction at
+// a time.
+template<CpuModel Model, size_t N>
+void RunInterleaved(const std::array<mos6502<Model>*, N>& cpus, int64_t cycles)
+{
+    typedef mos6502<Model> Cpu;
+    struct Single
     {
-        uint16_t addrL;
-        uint16_t addrH;
-        uint16_t addr;
+        uint8_t cycles;
+        void operator()(Cpu& cpu, uint16_t, uint8_t cycles)
+        {
+            this->cycles = cycles;
+            if(cpu.stopReason == STOP_NONE)
+            {
+                cpu.Stop(STOP_BUDGET, cpu.pc);
+            }
+        }
+    };
+    int64_t remaining[N];
+    unsigned live = 0;
+    for(size_t i = 0; i < N; i++)
+    {
+        remaining[i] = cycles;
+        cpus[i]->stopReason = STOP_NONE;
+        cpus[i]->nextEvent = 0;
+        live |= 1u << i;
+    }
+    uint16_t opcode;
+    while(live)
+    {
+        for(size_t i = 0; i < N; i++)
+        {
+            Cpu& cpu = *cpus[i];
+            if(remaining[i] > 0 && cpu.cycleCount < cpu.nextEvent && cpu.stopReason == STOP_NONE && !cpu.waiting)
+            {
+                remaining[i] -= cpu.Step(opcode);
+                continue;
+            }
+            if(!(live >> i & 1))
+            {
+                continue;
+            }
+            Single single = { 0 };
+            uint64_t idle = cpu.idleCycles;
+            StopReason reason = cpu.stopReason == STOP_NONE ? cpu.Run(remaining[i], single) : cpu.stopReason;
+            remaining[i] -= single.cycles + (cpu.idleCycles - idle);
+            if(reason != STOP_BUDGET || single.cycles == 0 || remaining[i] <= 0)
+            {
+                live &= ~(1u << i);
+                continue;
+            }
+            cpu.stopReason = STOP_NONE;
+        }
+    }
+}
 
-        addrL = Read(pc++);
-        addrH = Read(pc++);
+// Define RUN6502_LIBRARY to include the emulator without the command line.
+#ifndef RUN6502_LIBRARY
 
-        addr = addrL + (addrH << 8);
+uint8_t memory[65536];
 
-        return addr;
+void Write(uint16_t i, uint8_t data)
+{
+    memory[i] = data;
+}
+
+uint8_t Read(uint16_t i)
+{
+    return memory[i];
+}
+
+// What to do with undocumented NMOS opcodes.
+enum UndocumentedPolicy { UNDOC_ALLOW, UNDOC_COUNT, UNDOC_REJECT };
+
+// Emulator settings from the command line.
+struct Options
+{
+    CpuModel model = NMOS_6502;
+    UndocumentedPolicy undoc = UNDOC_ALLOW;
+    uint64_t irqPeriod = 0;
+    uint64_t nmiPeriod = 0;
+    double mhz = 0;
+    double sliceHz = 60;
+    int64_t cycles = INT64_MAX;
+    double timeout = 0;
+    bool exitRts = true;
+    bool exitBrk = false;
+    bool exitLoop = false;
+    std::vector<uint16_t> exitPcs;
+    std::vector<uint16_t> exitWrites;
+    std::vector<std::pair<uint16_t, const char*> > breakpoints;
+    struct Watch { uint16_t first, last; uint8_t kind; bool stop; };
+    std::vector<Watch> watchpoints;
+    bool sanitize = false;
+    int32_t timer = -1;
+    struct SweepVar { uint16_t addr; bool word; std::vector<uint16_t> values; };
+    std::vector<SweepVar> inputs;
+    std::vector<SweepVar> outputs;
+    const char* csv = NULL;
+    int threads = 0;
+    bool timing = false;
+    uint64_t samples = 0;
+    int32_t wcet = -1;
+    std::vector<std::pair<uint16_t, uint64_t> > loopBounds;
+    const char* aot = NULL;
+    std::vector<uint16_t> entries;
+    const char* cache = NULL;
+    bool pages = false;
+    int interleave = 0;
+    size_t machines = 0;
+    int machinePages = 0;
+    bool sparse = false;
+    const char* dump = NULL;
+    const char* diff = NULL;
+    bool hashes = false;
+    const char* save = NULL;
+    int32_t saveAtPc = -1;
+    uint64_t saveAtCycle = 0;
+    const char* resume = NULL;
+    uint64_t checkpoint = 0;
+    int keyframe = 16;
+    const char* monitor = NULL;
+    uint64_t monitorEvery = 1000000;
+    std::vector<MemoryRange> monitorRanges;
+    bool stats = false;
+};
+
+// Most input combinations a sweep covers, each keeping its result until the
+// CSV is written.
+static const uint64_t MAX_SWEEP_RUNS = 1 << 24;
+
+// Number of input combinations a sweep covers.
+static uint64_t SweepRuns(const Options& options)
+{
+    uint64_t runs = 1;
+    for(const auto& in : options.inputs)
+    {
+        runs *= in.values.size();
     }
+    return runs;
+}
 
-    uint16_t Addr_ZER()
+// Input values of one combination, the first input varying fastest.
+static void SweepInputs(const Options& options, uint64_t run, std::vector<uint16_t>& values)
+{
+    values.clear();
+    for(const auto& in : options.inputs)
     {
-        return Read(pc++);
+        values.push_back(in.values[run % in.values.size()]);
+        run /= in.values.size();
     }
+}
 
-    uint16_t Addr_IMP()
+// Parses b:ADDR or w:ADDR, then for inputs =LO-HI or =V,V,... in decimal or 0x hex.
+static bool ParseSweepVar(std::vector<Options::SweepVar>& vars, const char* spec, bool input)
+{
+    Options::SweepVar var;
+    if((spec[0] != 'b' && spec[0] != 'w') || spec[1] != ':')
     {
-        return 0; // Not used.
+        return false;
+    }
+    var.word = spec[0] == 'w';
+    char* end;
+    var.addr = strtol(spec + 2, &end, 16);
+    if(!input)
+    {
+        vars.push_back(var);
+        return *end == '\0';
+    }
+    if(*end != '=')
+    {
+        return false;
+    }
+    long max = var.word ? 0xFFFF : 0xFF;
+    do
+    {
+        long lo = strtol(end + 1, &end, 0);
+        long hi = lo;
+        if(*end == '-')
+        {
+            hi = strtol(end + 1, &end, 0);
+        }
+        if(lo < 0 || hi > max || hi < lo)
+        {
+            return false;
+        }
+        for(long v = lo; v <= hi; v++)
+        {
+            var.values.push_back(v);
+        }
     }
+    while(*end == ',');
+    vars.push_back(var);
+    return *end == '\0';
+}
 
-    uint16_t Addr_REL()
+// Parses [r|w|c][s]:ADDR[-ADDR] into a watchpoint.
+static bool ParseWatch(Options& options, const char* spec)
+{
+    Options::Watch w = { 0, 0, 0, false };
+    for(; *spec && *spec != ':'; spec++)
     {
-        uint16_t offset;
-        uint16_t addr;
+        if(*spec == 'r') w.kind |= 1;
+        else if(*spec == 'w') w.kind |= 2;
+        else if(*spec == 'c') w.kind |= 4;
+        else if(*spec == 's') w.stop = true;
+        else return false;
+    }
+    if(*spec != ':' || w.kind == 0)
+    {
+        return false;
+    }
+    char* end;
+    w.first = w.last = strtol(spec + 1, &end, 16);
+    if(*end == '-')
+    {
+        w.last = strtol(end + 1, &end, 16);
+    }
+    if(*end || w.last < w.first)
+    {
+        return false;
+    }
+    options.watchpoints.push_back(w);
+    return true;
+}
 
-        offset = (uint16_t)Read(pc++);
-        if (offset & 0x80) offset |= 0xFF00;
-        addr = pc + (int16_t)offset;
-        return addr;
+// Parses one -exit condition, the first of which replaces the default.
+static bool ParseExit(Options& options, const char* cond, bool first)
+{
+    if(first)
+    {
+        options.exitRts = false;
     }
+    if(strcmp(cond, "rts") == 0) options.exitRts = true;
+    else if(strcmp(cond, "brk") == 0) options.exitBrk = true;
+    else if(strcmp(cond, "loop") == 0) options.exitLoop = true;
+    else if(strncmp(cond, "pc:", 3) == 0) options.exitPcs.push_back(strtol(cond + 3, NULL, 16));
+    else if(strncmp(cond, "write:", 6) == 0) options.exitWrites.push_back(strtol(cond + 6, NULL, 16));
+    else return false;
+    return true;
+}
 
-    uint16_t Addr_ABI()
+template<CpuModel Model>
+void Setup(mos6502<Model>& mos, uint8_t* ram, uint16_t start, size_t size, const Options& options)
+{
+    mos.MapRam(ram);
+    if(options.sanitize)
     {
-        uint16_t addrL;
-        uint16_t addrH;
-        uint16_t effL;
-        uint16_t effH;
-        uint16_t abs;
-        uint16_t addr;
+        mos.Sanitize();
+        mos.MarkInitialized(start, size);
+    }
+    mos.Reset(start);
+    if(options.timer >= 0)
+    {
+        mos.MapTimer(options.timer);
+    }
+    if(options.resume)
+    {
+        const char* error = mos.LoadState(options.resume);
+        if(error)
+        {
+            printf("error: %s: %s\n", options.resume, error);
+            exit(1);
+        }
+    }
+    if(options.exitRts)
+    {
+        mos.ExitOnRts();
+    }
+    if(options.exitBrk)
+    {
+        mos.ExitOnBrk();
+    }
+    if(options.exitLoop)
+    {
+        mos.ExitOnLoop();
+    }
+    for(uint16_t addr : options.exitPcs)
+    {
+        mos.ExitAtPc(addr);
+    }
+    for(uint16_t addr : options.exitWrites)
+    {
+        mos.ExitOnWrite(addr);
+    }
+    for(const auto& w : options.watchpoints)
+    {
+        mos.AddWatchpoint(w.first, w.last, w.kind, w.stop);
+    }
+    for(const auto& b : options.breakpoints)
+    {
+        const char* error = mos.AddBreakpoint(b.first, b.second);
+        if(error)
+        {
+            printf("error: breakpoint condition '%s': %s\n", b.second, error);
+            exit(1);
+        }
+    }
+    if(options.irqPeriod)
+    {
+        mos.ScheduleIRQ(options.irqPeriod, options.irqPeriod);
+    }
+    if(options.nmiPeriod)
+    {
+        mos.ScheduleNMI(options.nmiPeriod, options.nmiPeriod);
+    }
+    if(options.undoc == UNDOC_REJECT)
+    {
+        mos.RejectUndocumented();
+    }
+    if(options.timeout > 0)
+    {
+        mos.SetTimeout(options.timeout);
+    }
+}
 
-        addrL = Read(pc++);
-        addrH = Read(pc++);
+// Entry points of recompiled code, linked in from -aot output or loaded
+// from the translation cache. Without them everything is interpreted.
+struct Native
+{
+    void (*setup)(void*) = NULL;
+    void (*run)(void*) = NULL;
+};
 
-        abs = (addrH << 8) | addrL;
+#ifdef RUN6502_RECOMPILED
+extern "C" void run6502_recompiled_setup(void* cpu);
+extern "C" void run6502_recompiled(void* cpu);
+#endif
 
-        effL = Read(abs);
+// Runs recompiled code up to the next interrupt, stop or end of budget, and
+// interprets one instruction wherever it leaves off.
+template<CpuModel Model>
+StopReason RunNative(mos6502<Model>& cpu, int64_t cycles, const Native& native)
+{
+    typedef mos6502<Model> Cpu;
+    if(!native.run)
+    {
+        return cpu.Run(cycles);
+    }
+    uint64_t end = cycles == INT64_MAX ? Cpu::NEVER : cpu.cycleCount + cycles;
+    native.setup(&cpu);
+    // Recompiled code does not fetch, so its pages count as executed up front.
+    cpu.ClassifyPages();
+    for(int page = 0; page < 256; page++)
+    {
+        if(cpu.pageTraps[page] & Cpu::TRAP_CODE)
+        {
+            cpu.MarkExecuted(page);
+        }
+    }
+    cpu.stopReason = STOP_NONE;
+    while(!cpu.stopped)
+    {
+        if(cpu.cycleCount >= end)
+        {
+            cpu.Stop(STOP_BUDGET, cpu.pc);
+            break;
+        }
+        if(cpu.hasDeadline && std::chrono::steady_clock::now() >= cpu.deadline)
+        {
+            cpu.Stop(STOP_DEADLINE, cpu.pc);
+            break;
+        }
+        cpu.nextEvent = std::min(end, std::min(cpu.nmiAt, cpu.irqAt));
+        if(cpu.hasDeadline)
+        {
+            cpu.nextEvent = std::min(cpu.nextEvent, cpu.cycleCount + Cpu::deadlineBlock);
+        }
+        if(!cpu.waiting && (!cpu.irqLine || (cpu.status & INTERRUPT)))
+        {
+            native.run(&cpu);
+        }
+        if(cpu.stopReason != STOP_NONE)
+        {
+            break;
+        }
+        StopReason reason = cpu.Run(1, Cpu::INST_COUNT);
+        if(reason != STOP_BUDGET)
+        {
+            return reason;
+        }
+        cpu.stopReason = STOP_NONE;
+    }
+    return cpu.stopReason;
+}
 
-#ifndef CMOS_INDIRECT_JMP_FIX
-        effH = Read((abs & 0xFF00) + ((abs + 1) & 0x00FF) );
-#else
-        effH = Read(abs + 1);
+// The code reachable from the entry points as C++ for RunNative.
+template<CpuModel Model>
+std::string Translate(uint16_t start, size_t size, const Options& options, size_t& count)
+{
+    static const char* models[] = { "NMOS_6502", "CMOS_65C02", "ROCKWELL_65C02", "WDC_65C02" };
+    mos6502<Model> mos { Read, Write };
+    std::vector<uint8_t> ram(memory, memory + 65536);
+    Setup(mos, ram.data(), start, size, options);
+    Recompiler<Model> recompiler(mos);
+    std::vector<uint16_t> entries(options.entries);
+    if(entries.empty())
+    {
+        entries.push_back(start);
+    }
+    recompiler.Discover(entries);
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    count = recompiler.Emit(out, models[Model], "out.bin");
+    fclose(out);
+    std::string source(text, length);
+    free(text);
+    return source;
+}
+
+template<CpuModel Model>
+void Recompile(uint16_t start, size_t size, const Options& options)
+{
+    size_t count;
+    std::string source = Translate<Model>(start, size, options, count);
+    FILE* out = fopen(options.aot, "w");
+    if(out == NULL)
+    {
+        printf("error: could not open %s\n", options.aot);
+        exit(1);
+    }
+    fwrite(source.data(), 1, source.size(), out);
+    fclose(out);
+    printf("AOT: %zu instructions written to %s\n", count, options.aot);
+    exit(0);
+}
+
+// The main.cpp that cache misses compile against. Builds can name it with
+// -DRUN6502_SOURCE=/path/to/main.cpp, as run.sh does.
+#ifndef RUN6502_SOURCE
+#define RUN6502_SOURCE __FILE__
 #endif
 
-        addr = effL + 0x100 * effH;
+// Finds main.cpp: where the build named it, next to the executable or in
+// the current directory. Returns its absolute path, or an empty string.
+static std::string SourcePath()
+{
+    std::string source(RUN6502_SOURCE);
+    std::string name = source.substr(source.rfind('/') + 1);
+    std::vector<std::string> candidates = { source };
+    char exe[4096];
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if(length > 0)
+    {
+        std::string dir(exe, length);
+        candidates.push_back(dir.substr(0, dir.rfind('/') + 1) + name);
+    }
+    candidates.push_back(name);
+    for(const std::string& candidate : candidates)
+    {
+        char* path = realpath(candidate.c_str(), NULL);
+        if(path)
+        {
+            std::string found(path);
+            free(path);
+            return found;
+        }
+    }
+    return "";
+}
 
-        return addr;
+// Quotes a string for the shell.
+static std::string ShellQuote(const std::string& s)
+{
+    std::string quoted = "'";
+    for(char c : s)
+    {
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+}
+
+// Loads the translation of the image from the cache directory, compiling it
+// with the host compiler on a miss. Entries are keyed by a hash of the
+// translation, which holds the code page contents and model, and of the
+// main.cpp it compiles against. A library whose CPU layout differs from
+// this build's, as when main.cpp changed since the build, is refused.
+template<CpuModel Model>
+Native LoadCached(uint16_t start, size_t size, const Options& options)
+{
+    Native native;
+    size_t count;
+    std::string source = Translate<Model>(start, size, options, count);
+    std::string path = SourcePath();
+    FILE* fp = path.empty() ? NULL : fopen(path.c_str(), "rb");
+    if(fp == NULL)
+    {
+        printf("error: could not find %s to compile against, build with -DRUN6502_SOURCE=/path/to/main.cpp\n", RUN6502_SOURCE);
+        exit(1);
+    }
+    std::string emulator;
+    char buffer[65536];
+    for(size_t n; (n = fread(buffer, 1, sizeof(buffer), fp)) > 0;)
+    {
+        emulator.append(buffer, n);
+    }
+    fclose(fp);
+    uint64_t hash = 14695981039346656037ULL;
+    for(const std::string& part : { emulator, source })
+    {
+        for(unsigned char c : part)
+        {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+    }
+    std::string base = std::string(options.cache) + "/" + std::to_string(hash);
+    std::string library = base + ".so";
+    bool hit = access(library.c_str(), R_OK) == 0;
+    if(!hit)
+    {
+        // Processes missing on the same translation at once each write and
+        // compile their own files, and only the renames into place race.
+        std::string scratch = base + "." + std::to_string(getpid());
+        mkdir(options.cache, 0755);
+        FILE* out = fopen((scratch + ".cpp").c_str(), "w");
+        if(out == NULL)
+        {
+            printf("error: could not write to cache %s\n", options.cache);
+            exit(1);
+        }
+        fwrite(source.data(), 1, source.size(), out);
+        fclose(out);
+        std::string dir = path.substr(0, path.rfind('/'));
+        const char* cxx = getenv("CXX") ? getenv("CXX") : "c++";
+        std::string command = ShellQuote(cxx) + " -O2 -shared -fPIC -DRUN6502_LIBRARY -I" + ShellQuote(dir)
+            + " -o " + ShellQuote(scratch + ".tmp") + " " + ShellQuote(scratch + ".cpp")
+            + " && mv " + ShellQuote(scratch + ".cpp") + " " + ShellQuote(base + ".cpp")
+            + " && mv " + ShellQuote(scratch + ".tmp") + " " + ShellQuote(library);
+        if(system(command.c_str()) != 0)
+        {
+            printf("error: could not compile %s.cpp\n", scratch.c_str());
+            exit(1);
+        }
+    }
+    void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(handle == NULL)
+    {
+        printf("error: %s\n", dlerror());
+        exit(1);
+    }
+    native.setup = (void (*)(void*)) dlsym(handle, "run6502_recompiled_setup");
+    native.run = (void (*)(void*)) dlsym(handle, "run6502_recompiled");
+    size_t (*layout)() = (size_t (*)()) dlsym(handle, "run6502_recompiled_layout");
+    if(native.setup == NULL || native.run == NULL || layout == NULL)
+    {
+        printf("error: %s is not a translation\n", library.c_str());
+        exit(1);
     }
-
-    uint16_t Addr_ZEX()
+    if(layout() != sizeof(mos6502<Model>))
     {
-        uint16_t addr = (Read(pc++) + X) % 256;
-        return addr;
+        printf("error: %s was compiled against a different main.cpp than this build, rebuild the emulator\n", library.c_str());
+        exit(1);
     }
+    printf("CACHE: %s %s, %zu instructions\n", hit ? "hit" : "miss", library.c_str(), count);
+    return native;
+}
 
-    uint16_t Addr_ZEY()
+// Runs N copies of the image one after another, then N more interleaved on
+// one thread, and compares the throughput of the two.
+template<CpuModel Model, size_t N>
+void Interleave(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    std::vector<std::vector<uint8_t> > ram(2 * N, std::vector<uint8_t>(memory, memory + 65536));
+    std::vector<std::unique_ptr<Cpu> > cpus;
+    for(size_t i = 0; i < 2 * N; i++)
     {
-        uint16_t addr = (Read(pc++) + Y) % 256;
-        return addr;
+        cpus.emplace_back(new Cpu { Read, Write });
     }
-
-    uint16_t Addr_ABX()
+    for(size_t i = 0; i < N; i++)
     {
-        uint16_t addr;
-        uint16_t addrL;
-        uint16_t addrH;
-
-        addrL = Read(pc++);
-        addrH = Read(pc++);
-
-        addr = addrL + (addrH << 8) + X;
-        return addr;
+        Setup(*cpus[i], ram[i].data(), start, size, options);
     }
-
-    uint16_t Addr_ABY()
+    auto begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < N; i++)
     {
-        uint16_t addr;
-        uint16_t addrL;
-        uint16_t addrH;
-
-        addrL = Read(pc++);
-        addrH = Read(pc++);
-
-        addr = addrL + (addrH << 8) + Y;
-        return addr;
+        cpus[i]->Run(options.cycles);
     }
-
-
-    uint16_t Addr_INX()
+    double sequential = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    // Set up after the sequential runs so that -timeout applies alike.
+    std::array<Cpu*, N> group;
+    for(size_t i = 0; i < N; i++)
     {
-        uint16_t zeroL;
-        uint16_t zeroH;
-        uint16_t addr;
-
-        zeroL = (Read(pc++) + X) % 256;
-        zeroH = (zeroL + 1) % 256;
-        addr = Read(zeroL) + (Read(zeroH) << 8);
-
-        return addr;
+        Setup(*cpus[N + i], ram[N + i].data(), start, size, options);
+        group[i] = cpus[N + i].get();
     }
-
-    uint16_t Addr_INY()
+    begin = std::chrono::steady_clock::now();
+    RunInterleaved(group, options.cycles);
+    double interleaved = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t cycles = 0;
+    bool same = true;
+    for(size_t i = 0; i < N; i++)
     {
-        uint16_t zeroL;
-        uint16_t zeroH;
-        uint16_t addr;
-
-        zeroL = Read(pc++);
-        zeroH = (zeroL + 1) % 256;
-        addr = Read(zeroL) + (Read(zeroH) << 8) + Y;
-
-        return addr;
+        const Cpu& a = *cpus[i];
+        const Cpu& b = *cpus[N + i];
+        cycles += a.cycleCount;
+        same = same && a.cycleCount == b.cycleCount && a.pc == b.pc && a.A == b.A && a.X == b.X && a.Y == b.Y
+            && a.sp == b.sp && a.status == b.status && a.stopReason == b.stopReason && ram[i] == ram[N + i];
     }
-
-    void Reset(uint16_t start)
+    printf("INTERLEAVE: %zu machines, %llu cycles\n", N, (unsigned long long) cycles);
+    printf("sequential  %.3f s %.1f Mcycles/s\n", sequential, cycles / sequential / 1e6);
+    printf("interleaved %.3f s %.1f Mcycles/s, %.2fx\n", interleaved, cycles / interleaved / 1e6, sequential / interleaved);
+    // Machines stopped by a wall clock timeout end wherever they got to.
+    if(!same && options.timeout == 0)
     {
-        Write(rstVectorH, start >> 8);
-        Write(rstVectorL, start & 0xFF);
-
-        A = 0x00;
-        Y = 0x00;
-        X = 0x00;
-
-        pc = (Read(rstVectorH) << 8) + Read(rstVectorL); // Load PC from reset vector.
-
-        sp = 0xFD;
-
-        status |= CONSTANT;
-
-        illegalOpcode = false;
+        puts("error: interleaved machines ended in a different state");
+        exit(1);
     }
+    exit(0);
+}
 
-    void StackPush(uint8_t byte)
+// Runs many copies of the image from a MachinePool, each thread with an
+// engine of its own taking turns of machineSlice cycles over its share of
+// the machines, and reports the memory they take.
+template<CpuModel Model>
+void Machines(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    static const int64_t machineSlice = 1 << 20;
+    int pages = options.machinePages;
+    if(pages == 0)
     {
-        Write(0x0100 + sp, byte);
-        if(sp == 0x00) sp = 0xFF;
-        else sp--;
+        pages = std::max(2, (int) ((start + size - 1) >> 8) + 1);
     }
-
-    uint8_t StackPop()
+    pages = std::min(pages, 256);
+    CpuState initial;
+    MachinePool::Schedule schedule;
     {
-        if(sp == 0xFF) sp = 0x00;
-        else sp++;
-        return Read(0x0100 + sp);
+        Cpu mos { Read, Write };
+        Setup(mos, memory, start, size, options);
+        mos.Save(initial);
+        schedule.irqAt = mos.irqAt;
+        schedule.nmiAt = mos.nmiAt;
     }
-
-    void IRQ()
+    MachinePool pool;
+    if(options.sparse ? !pool.CreateSparse(options.machines, memory, initial, schedule) : !pool.Create(options.machines, pages, memory, initial, schedule))
     {
-        if(!IF_INTERRUPT())
+        printf("error: could not allocate %zu machines\n", options.machines);
+        exit(1);
+    }
+    if(options.sparse)
+    {
+        printf("MACHINES: %zu with sparse memory and %zu byte states\n", pool.count, sizeof(CpuState));
+    }
+    else
+    {
+        printf("MACHINES: %zu with %d pages of memory and %zu byte states\n", pool.count, pages, sizeof(CpuState));
+    }
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::unique_ptr<Cpu> > engines;
+    for(int t = 0; t < threads; t++)
+    {
+        engines.emplace_back(new Cpu { Read, Write });
+        Setup(*engines[t], memory, start, size, options);
+    }
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for(int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
         {
-            SET_BREAK(0);
-            StackPush((pc >> 8) & 0xFF);
-            StackPush(pc & 0xFF);
-            StackPush(status);
-            SET_INTERRUPT(1);
-            pc = (Read(irqVectorH) << 8) + Read(irqVectorL);
-        }
+            Cpu& engine = *engines[t];
+            size_t first = pool.count * t / threads;
+            size_t last = pool.count * (t + 1) / threads;
+            for(bool live = true; live;)
+            {
+                live = false;
+                for(size_t i = first; i < last; i++)
+                {
+                    const CpuState& state = pool.states[i];
+                    int64_t remaining = options.cycles - (int64_t) (state.cycleCount - initial.cycleCount);
+                    if(state.Reason() == STOP_NONE || (state.Reason() == STOP_BUDGET && remaining > 0))
+                    {
+                        live = pool.Run(engine, i, std::min(remaining, machineSlice)) == STOP_BUDGET || live;
+                    }
+                }
+            }
+        });
     }
-
-    void NMI()
+    for(auto& w : workers)
     {
-        SET_BREAK(0);
-        StackPush((pc >> 8) & 0xFF);
-        StackPush(pc & 0xFF);
-        StackPush(status);
-        SET_INTERRUPT(1);
-        pc = (Read(nmiVectorH) << 8) + Read(nmiVectorL);
+        w.join();
     }
-
-    void Run(int32_t cyclesRemaining, uint64_t& cycleCount, CycleMethod cycleMethod = CYCLE_COUNT)
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    uint64_t cycles = 0;
+    std::map<StopReason, size_t> reasons;
+    for(size_t i = 0; i < pool.count; i++)
     {
-        uint8_t opcode;
-        Instr instr;
-
-        while(cyclesRemaining > 0 && !illegalOpcode)
+        cycles += pool.states[i].cycleCount - initial.cycleCount;
+        reasons[pool.states[i].Reason()]++;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("RUN: %llu cycles in %.3f s, %.1f Mcycles/s on %d threads, %.1f MB resident at peak\n",
+        (unsigned long long) cycles, seconds, cycles / seconds / 1e6, threads, usage.ru_maxrss / 1024.0);
+    printf("MEMORY: %.1f MB of arenas in %s pages", pool.arena.reserved / 1048576.0, pool.arena.hugetlb ? "2MB" : "transparent huge");
+    if(options.sparse)
+    {
+        uint64_t owned = 0;
+        for(size_t i = 0; i < pool.count; i++)
         {
-            // Fetch.
-            opcode = Read(pc++);
-
-            // Decode.
-            instr = InstrTable[opcode];
-
-            // Execute.
-            Exec(instr);
-            cycleCount += instr.cycles;
-            cyclesRemaining -= cycleMethod == CYCLE_COUNT ? instr.cycles : 1;
+            owned += pool.sparse[i].count;
         }
+        printf(", %llu pages written, %.1f per machine", (unsigned long long) owned, (double) owned / pool.count);
     }
-
-    void Exec(Instr i)
+    printf("\n");
+    for(const auto& r : reasons)
     {
-        uint16_t src = (this->*i.addr)();
-        (this->*i.code)(src);
+        printf("%zu stopped on %s\n", r.second, StopReasonName(r.first));
     }
+    exit(0);
+}
 
-    void Op_ILLEGAL(uint16_t src)
+// Runs the image once per combination of input values on a pool of threads.
+// Every run starts from its own copy of memory as loaded.
+template<CpuModel Model>
+void Sweep(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    struct Result
     {
-        illegalOpcode = true;
-    }
-
-    void Op_ADC(uint16_t src)
+        std::vector<uint16_t> outputs;
+        uint64_t cycles;
+        StopReason reason;
+    };
+    uint64_t runs = SweepRuns(options);
+    std::vector<Result> results(runs);
+    std::atomic<uint64_t> next(0);
+    auto worker = [&]()
     {
-        uint8_t m = Read(src);
-        unsigned int tmp = m + A + (IF_CARRY() ? 1 : 0);
-        SET_ZERO(!(tmp & 0xFF));
-        if (IF_DECIMAL())
+        std::vector<uint8_t> ram(65536);
+        std::vector<uint16_t> values;
+        for(uint64_t run; (run = next++) < runs;)
         {
-            if (((A & 0xF) + (m & 0xF) + (IF_CARRY() ? 1 : 0)) > 9) tmp += 6;
-            SET_NEGATIVE(tmp & 0x80);
-            SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
-            if (tmp > 0x99)
+            memcpy(ram.data(), memory, 65536);
+            Cpu mos { Read, Write };
+            Setup(mos, ram.data(), start, size, options);
+            SweepInputs(options, run, values);
+            for(size_t i = 0; i < values.size(); i++)
             {
-                tmp += 96;
+                const auto& in = options.inputs[i];
+                ram[in.addr] = values[i] & 0xFF;
+                if(in.word)
+                {
+                    ram[(in.addr + 1) & 0xFFFF] = values[i] >> 8;
+                }
+            }
+            for(const auto& in : options.inputs)
+            {
+                if(options.sanitize)
+                {
+                    mos.MarkInitialized(in.addr, in.word ? 2 : 1);
+                }
+            }
+            Result& result = results[run];
+            result.reason = mos.Run(options.cycles);
+            result.cycles = mos.cycleCount;
+            for(const auto& out : options.outputs)
+            {
+                uint16_t value = mos.Peek(out.addr);
+                if(out.word)
+                {
+                    value |= mos.Peek((out.addr + 1) & 0xFFFF) << 8;
+                }
+                result.outputs.push_back(value);
             }
-            SET_CARRY(tmp > 0x99);
-        }
-        else
-        {
-            SET_NEGATIVE(tmp & 0x80);
-            SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
-            SET_CARRY(tmp > 0xFF);
         }
-
-        A = tmp & 0xFF;
+    };
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for(int i = 0; i < threads; i++)
+    {
+        pool.emplace_back(worker);
     }
-
-    void Op_AND(uint16_t src)
+    for(auto& t : pool)
     {
-        uint8_t m = Read(src);
-        uint8_t res = m & A;
-        SET_NEGATIVE(res & 0x80);
-        SET_ZERO(!res);
-        A = res;
+        t.join();
     }
-
-    void Op_ASL(uint16_t src)
+    FILE* out = options.csv ? fopen(options.csv, "w") : stdout;
+    if(out == NULL)
     {
-        uint8_t m = Read(src);
-        SET_CARRY(m & 0x80);
-        m <<= 1;
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Write(src, m);
+        printf("error: could not open %s\n", options.csv);
+        exit(1);
     }
-
-    void Op_ASL_ACC(uint16_t src)
+    for(const auto& in : options.inputs)
     {
-        uint8_t m = A;
-        SET_CARRY(m & 0x80);
-        m <<= 1;
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        fprintf(out, "in_%04X,", in.addr);
     }
-
-    void Op_BCC(uint16_t src)
+    for(const auto& o : options.outputs)
     {
-        if (!IF_CARRY())
-        {
-            pc = src;
-        }
+        fprintf(out, "out_%04X,", o.addr);
     }
-
-    void Op_BCS(uint16_t src)
+    fprintf(out, "cycles,stop\n");
+    std::vector<uint16_t> values;
+    for(uint64_t run = 0; run < runs; run++)
     {
-        if (IF_CARRY())
+        SweepInputs(options, run, values);
+        for(uint16_t value : values)
         {
-            pc = src;
+            fprintf(out, "%u,", value);
         }
-    }
-
-    void Op_BEQ(uint16_t src)
-    {
-        if (IF_ZERO())
+        for(uint16_t value : results[run].outputs)
         {
-            pc = src;
+            fprintf(out, "%u,", value);
         }
+        fprintf(out, "%llu,%s\n", (unsigned long long) results[run].cycles, StopReasonName(results[run].reason));
     }
-
-    void Op_BIT(uint16_t src)
+    if(out != stdout)
     {
-        uint8_t m = Read(src);
-        uint8_t res = m & A;
-        SET_NEGATIVE(res & 0x80);
-        status = (status & 0x3F) | (uint8_t)(m & 0xC0);
-        SET_ZERO(!res);
+        fclose(out);
     }
+    exit(0);
+}
 
-    void Op_BMI(uint16_t src)
+static void PrintInputs(const Options& options, uint64_t run)
+{
+    std::vector<uint16_t> values;
+    SweepInputs(options, run, values);
+    for(size_t i = 0; i < values.size(); i++)
     {
-        if (IF_NEGATIVE())
-        {
-            pc = src;
-        }
+        printf(" $%04X=%u", options.inputs[i].addr, values[i]);
     }
+}
 
-    void Op_BNE(uint16_t src)
+// Runs the image over every combination of inputs, or a random sample of
+// them, and reports the spread of cycle counts and the branches and indexed
+// reads whose penalty cycles differ from one input to another.
+template<CpuModel Model>
+void Timing(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    enum { OUTCOME = 1, CROSSING = 2 };
+    std::vector<uint8_t> ram(memory, memory + 65536);
+    Cpu mos { Read, Write };
+    Setup(mos, ram.data(), start, size, options);
+    mos.TrackDirtyPages();
+    typename Cpu::PenaltyCounter probe(mos);
+    std::vector<std::array<uint32_t, 3> > baseline(65536);
+    std::vector<uint16_t> baselineTouched;
+    std::vector<uint8_t> flags(65536);
+    std::vector<uint16_t> values;
+    uint64_t combinations = SweepRuns(options);
+    uint64_t runs = options.samples ? options.samples : combinations;
+    uint64_t min = UINT64_MAX, max = 0, minRun = 0, maxRun = 0;
+    std::mt19937_64 random(6502);
+    for(uint64_t i = 0; i < runs; i++)
     {
-        if (!IF_ZERO())
+        uint64_t run = options.samples ? random() % combinations : i;
+        SweepInputs(options, run, values);
+        for(size_t j = 0; j < values.size(); j++)
+        {
+            mos.Write(options.inputs[j].addr, values[j] & 0xFF);
+            if(options.inputs[j].word)
+            {
+                mos.Write(options.inputs[j].addr + 1, values[j] >> 8);
+            }
+        }
+        mos.status = CONSTANT;
+        mos.cycleCount = 0;
+        mos.Reset(start);
+        StopReason reason = mos.Run(options.cycles, probe);
+        if(reason != STOP_EXIT)
+        {
+            printf("STOP: %s at $%04X after %llu cycles for", StopReasonName(reason),
+                mos.stopPc, (unsigned long long) mos.cycleCount);
+            PrintInputs(options, run);
+            puts("");
+            exit(2);
+        }
+        if(mos.cycleCount < min) min = mos.cycleCount, minRun = run;
+        if(mos.cycleCount > max) max = mos.cycleCount, maxRun = run;
+        mos.RestoreDirtyPages(memory);
+        if(i == 0)
+        {
+            baseline.swap(probe.counts);
+            baselineTouched.swap(probe.touched);
+            probe.counts.assign(65536, { 0, 0, 0 });
+            probe.touched.clear();
+            continue;
+        }
+        for(const auto* list : { &probe.touched, &baselineTouched })
+        {
+            for(uint16_t pc : *list)
+            {
+                const std::array<uint32_t, 3>& a = baseline[pc];
+                const std::array<uint32_t, 3>& b = probe.counts[pc];
+                if(probe.branch[memory[pc]])
+                {
+                    if(a[0] != b[0] || a[1] + a[2] != b[1] + b[2]) flags[pc] |= OUTCOME;
+                    if(a[2] != b[2]) flags[pc] |= CROSSING;
+                }
+                else if(a[1] != b[1])
+                {
+                    flags[pc] |= CROSSING;
+                }
+            }
+        }
+        for(uint16_t pc : probe.touched)
         {
-            pc = src;
+            probe.counts[pc] = { 0, 0, 0 };
         }
+        probe.touched.clear();
     }
-
-    void Op_BPL(uint16_t src)
+    printf("TIMING: %llu runs, min %llu cycles for", (unsigned long long) runs, (unsigned long long) min);
+    PrintInputs(options, minRun);
+    printf(", max %llu cycles for", (unsigned long long) max);
+    PrintInputs(options, maxRun);
+    puts(min == max ? ", constant time" : "");
+    for(int pc = 0; pc < 65536; pc++)
     {
-        if (!IF_NEGATIVE())
+        if(flags[pc] & OUTCOME)
         {
-            pc = src;
+            printf("$%04X $%02X : branch taken or not depends on input\n", pc, Read(pc));
+        }
+        if(flags[pc] & CROSSING)
+        {
+            printf("$%04X $%02X : page crossing penalty depends on input\n", pc, Read(pc));
         }
     }
+    exit(min == max ? 0 : 1);
+}
 
-    void Op_BRK(uint16_t src)
+// Bounds the cycles of the routine at options.wcet statically, then checks
+// the bound against runs of it over the -in values, if any.
+template<CpuModel Model>
+void WorstCase(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    std::vector<uint8_t> ram(memory, memory + 65536);
+    Cpu mos { Read, Write };
+    Setup(mos, ram.data(), start, size, options);
+    Wcet<Model> wcet(mos);
+    for(const auto& b : options.loopBounds)
     {
-        pc++;
-        StackPush((pc >> 8) & 0xFF);
-        StackPush(pc & 0xFF);
-        StackPush(status | BREAK);
-        SET_INTERRUPT(1);
-        pc = (Read(irqVectorH) << 8) + Read(irqVectorL);
+        wcet.Bound(b.first, b.second);
+    }
+    uint64_t bound;
+    if(!wcet.Analyze(options.wcet, bound))
+    {
+        printf("WCET: %s\n", wcet.error);
+        exit(2);
+    }
+    for(const auto& f : wcet.functions)
+    {
+        printf("$%04X : %llu cycles\n", f.first, (unsigned long long) f.second);
+    }
+    for(const auto& l : wcet.loops)
+    {
+        printf("$%04X : loop in $%04X, %llu x %llu cycles, %llu in all\n", l.header, l.function, (unsigned long long) l.bound,
+            (unsigned long long) l.iteration, (unsigned long long) l.total);
+    }
+    printf("WCET: $%04X takes at most %llu cycles\n", options.wcet, (unsigned long long) bound);
+    if(options.inputs.empty())
+    {
+        exit(0);
     }
 
-    void Op_BVC(uint16_t src)
+    // Runs start with room on the stack and end when the routine returns
+    // above it, whether by RTS or RTI.
+    struct Return
     {
-        if (!IF_OVERFLOW())
+        void operator()(Cpu& cpu, uint16_t opcode, uint8_t)
+        {
+            if((opcode == 0x60 || opcode == 0x40) && cpu.sp > 0xF0)
+            {
+                cpu.Stop(STOP_EXIT, cpu.opPc);
+            }
+        }
+    } probe;
+    mos.TrackDirtyPages();
+    std::vector<uint16_t> values;
+    uint64_t combinations = SweepRuns(options);
+    uint64_t runs = options.samples ? options.samples : combinations;
+    uint64_t max = 0, maxRun = 0;
+    std::mt19937_64 random(6502);
+    for(uint64_t i = 0; i < runs; i++)
+    {
+        uint64_t run = options.samples ? random() % combinations : i;
+        SweepInputs(options, run, values);
+        for(size_t j = 0; j < values.size(); j++)
+        {
+            mos.Write(options.inputs[j].addr, values[j] & 0xFF);
+            if(options.inputs[j].word)
+            {
+                mos.Write(options.inputs[j].addr + 1, values[j] >> 8);
+            }
+        }
+        mos.status = CONSTANT;
+        mos.cycleCount = 0;
+        mos.Reset(options.wcet);
+        mos.sp = 0xF0;
+        StopReason reason = mos.Run(options.cycles, probe);
+        if(reason != STOP_EXIT)
+        {
+            printf("STOP: %s at $%04X after %llu cycles for", StopReasonName(reason),
+                mos.stopPc, (unsigned long long) mos.cycleCount);
+            PrintInputs(options, run);
+            puts("");
+            exit(2);
+        }
+        if(mos.cycleCount > max)
         {
-            pc = src;
+            max = mos.cycleCount;
+            maxRun = run;
         }
+        mos.RestoreDirtyPages(memory);
     }
+    printf("OBSERVED: %llu runs, max %llu cycles for", (unsigned long long) runs, (unsigned long long) max);
+    PrintInputs(options, maxRun);
+    puts(max <= bound ? ", within the bound" : ", BOUND EXCEEDED");
+    exit(max <= bound ? 0 : 1);
+}
 
-    void Op_BVS(uint16_t src)
+// Writes, compares against a reference and hashes memory as the run left it.
+static void Snapshot(const Options& options)
+{
+    if(options.dump)
     {
-        if (IF_OVERFLOW())
+        FILE* out = fopen(options.dump, "wb");
+        if(out == NULL || fwrite(memory, 1, 65536, out) != 65536)
         {
-            pc = src;
+            printf("error: could not write %s\n", options.dump);
+            exit(1);
         }
+        fclose(out);
     }
-
-    void Op_CLC(uint16_t src)
+    if(options.diff)
     {
-        SET_CARRY(0);
+        std::vector<uint8_t> reference(65536);
+        FILE* in = fopen(options.diff, "rb");
+        if(in == NULL || fread(reference.data(), 1, 65536, in) != 65536)
+        {
+            printf("error: could not read a 64K snapshot from %s\n", options.diff);
+            exit(1);
+        }
+        fclose(in);
+        std::vector<MemoryRange> ranges = DiffSnapshots(reference.data(), memory);
+        size_t bytes = 0;
+        for(const MemoryRange& r : ranges)
+        {
+            bytes += r.last - r.first + 1;
+        }
+        printf("DIFF: %zu bytes in %zu ranges differ from %s\n", bytes, ranges.size(), options.diff);
+        for(const MemoryRange& r : ranges)
+        {
+            printf(r.first == r.last ? "$%04X\n" : "$%04X-$%04X\n", r.first, r.last);
+        }
     }
-
-    void Op_CLD(uint16_t src)
+    if(options.hashes)
     {
-        SET_DECIMAL(0);
+        uint32_t hashes[256];
+        printf("HASH: %08X\n", HashSnapshot(memory, hashes));
+        for(int page = 0; page < 256; page += 8)
+        {
+            printf("$%04X", page << 8);
+            for(int i = 0; i < 8; i++)
+            {
+                printf(" %08X", hashes[page + i]);
+            }
+            printf("\n");
+        }
     }
+}
 
-    void Op_CLI(uint16_t src)
+// Runs to the -save-at address or cycle, writes a save-state there and exits.
+template<CpuModel Model>
+void SaveAt(mos6502<Model>& mos, const Options& options)
+{
+    StopReason reason;
+    StopReason expected;
+    if(options.saveAtPc >= 0)
     {
-        SET_INTERRUPT(0);
+        mos.AddBreakpoint(options.saveAtPc);
+        reason = mos.Run(options.cycles);
+        expected = STOP_BREAKPOINT;
     }
-
-    void Op_CLV(uint16_t src)
+    else
     {
-        SET_OVERFLOW(0);
+        reason = mos.Run(options.saveAtCycle > mos.cycleCount ? options.saveAtCycle - mos.cycleCount : 0);
+        expected = STOP_BUDGET;
     }
-
-    void Op_CMP(uint16_t src)
+    // Another -break stops the run just as the save point does, so it only
+    // counts at the save point's address.
+    if(reason != expected || (options.saveAtPc >= 0 && mos.stopPc != options.saveAtPc))
     {
-        unsigned int tmp = A - Read(src);
-        SET_CARRY(tmp < 0x100);
-        SET_NEGATIVE(tmp & 0x80);
-        SET_ZERO(!(tmp & 0xFF));
+        printf("STOP: %s at $%04X after %llu cycles, before the save point\n", StopReasonName(reason),
+            mos.stopPc, (unsigned long long) mos.cycleCount);
+        exit(2);
     }
-
-    void Op_CPX(uint16_t src)
+    const char* error = mos.SaveState(options.save);
+    if(error)
     {
-        unsigned int tmp = X - Read(src);
-        SET_CARRY(tmp < 0x100);
-        SET_NEGATIVE(tmp & 0x80);
-        SET_ZERO(!(tmp & 0xFF));
+        printf("error: %s: %s\n", options.save, error);
+        exit(1);
     }
+    printf("SAVED: %s at $%04X after %llu cycles\n", options.save, mos.pc, (unsigned long long) mos.cycleCount);
+    exit(0);
+}
 
-    void Op_CPY(uint16_t src)
+// Runs with a checkpoint every options.checkpoint cycles, then reports the
+// memory the history takes and checks that the last checkpoint rebuilds
+// from it. Then rewinds to the checkpoint halfway and runs again from it,
+// which must end in the same state and memory as the first time.
+template<CpuModel Model>
+StopReason RunCheckpointed(mos6502<Model>& mos, const Options& options)
+{
+    CheckpointHistory<Model> history(mos, options.keyframe);
+    uint64_t first = mos.cycleCount;
+    auto run = [&]()
     {
-        unsigned int tmp = Y - Read(src);
-        SET_CARRY(tmp < 0x100);
-        SET_NEGATIVE(tmp & 0x80);
-        SET_ZERO(!(tmp & 0xFF));
+        int64_t remaining = options.cycles - (mos.cycleCount - first);
+        StopReason reason;
+        for(;;)
+        {
+            uint64_t begin = mos.cycleCount;
+            reason = mos.Run(std::min<int64_t>(remaining, options.checkpoint));
+            remaining -= mos.cycleCount - begin;
+            if(reason != STOP_BUDGET || remaining <= 0)
+            {
+                return reason;
+            }
+            history.Take();
+        }
+    };
+    auto copyRam = [&](std::vector<uint8_t>& out)
+    {
+        out.assign(65536, 0);
+        for(int page = 0; page < 256; page++)
+        {
+            if(mos.ramPage[page])
+            {
+                memcpy(out.data() + page * 256, mos.ramPage[page], 256);
+            }
+        }
+    };
+    history.Take();
+    StopReason reason = run();
+    size_t keyframes = 0, keyframeBytes = 0, deltaBytes = 0, deltaMax = 0;
+    for(size_t i = 0; i < history.checkpoints.size(); i++)
+    {
+        size_t bytes = history.Bytes(i);
+        if(history.checkpoints[i].keyframe)
+        {
+            keyframes++;
+            keyframeBytes += bytes;
+        }
+        else
+        {
+            deltaBytes += bytes;
+            deltaMax = std::max(deltaMax, bytes);
+        }
     }
-
-    void Op_DEC(uint16_t src)
+    size_t count = history.checkpoints.size();
+    size_t deltas = count - keyframes;
+    printf("CHECKPOINTS: %zu every %llu cycles, %zu bytes in all, %.1f bytes each against 65536 uncompressed\n",
+        count, (unsigned long long) options.checkpoint, keyframeBytes + deltaBytes, (double) (keyframeBytes + deltaBytes) / count);
+    printf("%zu keyframes of %.1f bytes, %zu deltas of %.1f bytes, at most %zu\n", keyframes, (double) keyframeBytes / keyframes,
+        deltas, deltas ? (double) deltaBytes / deltas : 0.0, deltaMax);
+    std::vector<uint8_t> image(65536);
+    CpuState state;
+    auto begin = std::chrono::steady_clock::now();
+    history.Reconstruct(count - 1, image.data(), state);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    bool same = image == history.shadow && state.cycleCount == history.checkpoints.back().cpu.cycleCount;
+    printf("restoring the last checkpoint takes %.1f us and %s\n", seconds * 1e6, same ? "matches" : "DOES NOT MATCH");
+    std::vector<uint8_t> end, replay;
+    CpuState endState, replayState;
+    copyRam(end);
+    mos.Save(endState);
+    size_t middle = (count - 1) / 2;
+    history.Rewind(middle);
+    StopReason again = run();
+    copyRam(replay);
+    mos.Save(replayState);
+    std::vector<MemoryRange> diff = DiffSnapshots(end.data(), replay.data());
+    same = again == reason && diff.empty() && memcmp(&endState, &replayState, sizeof(CpuState)) == 0;
+    printf("running again from checkpoint %zu %s", middle, same ? "matches\n" : "DOES NOT MATCH");
+    for(size_t i = 0; i < diff.size() && i < 8; i++)
     {
-        uint8_t m = Read(src);
-        m = (m - 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Write(src, m);
+        printf(" $%04X-$%04X", diff[i].first, diff[i].last);
     }
+    printf(same ? "" : "\n");
+    return reason;
+}
 
-    void Op_DEX(uint16_t src)
+// Runs in slices of options.monitorEvery cycles and publishes the machine
+// to the shared memory segment options.monitor after each, and once more
+// when the run stops.
+template<CpuModel Model>
+StopReason RunMonitored(mos6502<Model>& mos, const Options& options)
+{
+    Monitor monitor;
+    if(!monitor.Create(options.monitor, options.monitorRanges))
     {
-        uint8_t m = X;
-        m = (m - 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        X = m;
+        printf("cannot create shared memory segment %s\n", options.monitor);
+        exit(1);
     }
-
-    void Op_DEY(uint16_t src)
+    uint64_t instructions = 0;
+    auto count = [&instructions](mos6502<Model>&, uint16_t opcode, uint8_t)
     {
-        uint8_t m = Y;
-        m = (m - 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Y = m;
+        instructions += opcode < 256;
+    };
+    monitor.Publish(mos, instructions);
+    int64_t remaining = options.cycles;
+    StopReason reason;
+    for(;;)
+    {
+        uint64_t begin = mos.cycleCount;
+        reason = mos.Run(std::min<int64_t>(remaining, options.monitorEvery), count);
+        remaining -= mos.cycleCount - begin;
+        if(reason != STOP_BUDGET || remaining <= 0)
+        {
+            break;
+        }
+        monitor.Publish(mos, instructions);
     }
+    monitor.Publish(mos, instructions, false);
+    printf("MONITOR: %s, %llu instructions\n", options.monitor, (unsigned long long) instructions);
+    return reason;
+}
 
-    void Op_EOR(uint16_t src)
+// Watches a segment published by -monitor and prints each new update,
+// until the run it watches stops.
+static void View(const char* name)
+{
+    MonitorReader reader;
+    for(int tries = 0; !reader.Open(name); tries++)
     {
-        uint8_t m = Read(src);
-        m = A ^ m;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        if(tries == 50)
+        {
+            printf("cannot open shared memory segment %s\n", name);
+            exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
-
-    void Op_INC(uint16_t src)
+    std::vector<uint8_t> storage(reader.size);
+    MonitorBlock* copy = (MonitorBlock*) storage.data();
+    uint32_t last = 0;
+    for(;;)
     {
-        uint8_t m = Read(src);
-        m = (m + 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Write(src, m);
+        uint32_t sequence = reader.Read(copy);
+        if(sequence != last)
+        {
+            last = sequence;
+            printf("%llu cycles %llu instructions PC=$%04X A=$%02X X=$%02X Y=$%02X SP=$%02X S=$%02X",
+                (unsigned long long) copy->cycleCount, (unsigned long long) copy->instructions,
+                copy->pc, copy->A, copy->X, copy->Y, copy->sp, copy->status);
+            const uint8_t* data = copy->data;
+            for(uint32_t i = 0; i < copy->rangeCount; i++)
+            {
+                printf(" $%04X:", copy->ranges[i].first);
+                for(uint32_t addr = copy->ranges[i].first; addr <= copy->ranges[i].last; addr++)
+                {
+                    printf("%02X", *data++);
+                }
+            }
+            putchar('\n');
+            fflush(stdout);
+            if(!copy->running)
+            {
+                return;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+}
 
-    void Op_INX(uint16_t src)
+// Prints the instruction mix of a -stats run: executions per opcode, per
+// addressing mode and per Op_ handler, most frequent first, then branch
+// outcomes, page crossings and the stack high-water mark.
+template<CpuModel Model>
+void ReportStats(const mos6502<Model>& cpu, const typename mos6502<Model>::StatsCounter& stats)
+{
+    typedef mos6502<Model> Cpu;
+    typedef typename Cpu::Instr Instr;
+    HandlerNames<Model> names;
+    uint64_t executed[257] = {}, taken[256] = {}, crossed[256] = {}, total = 0;
+    std::map<const char*, uint64_t> modes, ops;
+    for(int i = 0; i < 257; i++)
     {
-        uint8_t m = X;
-        m = (m + 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        X = m;
+        const Instr& instr = cpu.InstrTable[i];
+        bool decimalCycle = Cpu::cmos && (instr.code == &Cpu::Op_ADC || instr.code == &Cpu::Op_SBC);
+        for(int j = 0; j < 32; j++)
+        {
+            int extra = (j & 15) - instr.cycles - (decimalCycle && (j & 16));
+            executed[i] += stats.count[i][j];
+            if(i < 256 && extra > 0)
+            {
+                taken[i] += stats.count[i][j];
+                crossed[i] += extra == 2 || (instr.addr != &Cpu::Addr_REL && (i & 0x0F) != 0x0F) ? stats.count[i][j] : 0;
+            }
+        }
+        total += executed[i];
+        if(i < 256 && executed[i] > 0)
+        {
+            modes[names.Mode(instr.addr)] += executed[i];
+            ops[names.Op(instr.code)] += executed[i];
+        }
     }
-
-    void Op_INY(uint16_t src)
+    printf("STATS: %llu instructions, %llu traps, stack down to $%02X, %d bytes deep\n",
+        (unsigned long long) (total - executed[256]), (unsigned long long) executed[256], stats.lowestSp, 0xFF - stats.lowestSp);
+    std::vector<int> order;
+    for(int i = 0; i < 256; i++)
     {
-        uint8_t m = Y;
-        m = (m + 1) % 256;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Y = m;
+        if(executed[i] > 0)
+        {
+            order.push_back(i);
+        }
     }
-
-    void Op_JMP(uint16_t src)
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return executed[a] > executed[b]; });
+    puts("OPCODES");
+    for(int i : order)
     {
-        pc = src;
+        const Instr& instr = cpu.InstrTable[i];
+        printf("$%02X %-11s %-5s : %llu %.2f%%\n", i, names.Op(instr.code),
+            names.Mode(instr.addr), (unsigned long long) executed[i], 100.0 * executed[i] / total);
     }
-
-    void Op_JSR(uint16_t src)
+    for(const auto* group : { &modes, &ops })
     {
-        pc--;
-        StackPush((pc >> 8) & 0xFF);
-        StackPush(pc & 0xFF);
-        pc = src;
+        std::vector<std::pair<uint64_t, const char*> > sorted;
+        for(const auto& g : *group)
+        {
+            sorted.push_back({ g.second, g.first });
+        }
+        std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, const char*>& a,
+            const std::pair<uint64_t, const char*>& b) { return a.first > b.first; });
+        puts(group == &modes ? "ADDRESSING MODES" : "OPERATIONS");
+        for(const auto& g : sorted)
+        {
+            printf("%-11s : %llu %.2f%%\n", g.second, (unsigned long long) g.first, 100.0 * g.first / total);
+        }
     }
-
-    void Op_LDA(uint16_t src)
+    puts("BRANCHES");
+    for(int i : order)
     {
-        uint8_t m = Read(src);
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        const Instr& instr = cpu.InstrTable[i];
+        if(instr.addr == &Cpu::Addr_REL || (Cpu::rockwell && (i & 0x0F) == 0x0F))
+        {
+            printf("$%02X %-11s : %llu taken, %llu not, %.1f%% taken, %llu crossing pages\n", i,
+                names.Op(instr.code), (unsigned long long) taken[i],
+                (unsigned long long) (executed[i] - taken[i]), 100.0 * taken[i] / executed[i], (unsigned long long) crossed[i]);
+        }
     }
-
-    void Op_LDX(uint16_t src)
+    puts("PAGE CROSSINGS");
+    for(int i : order)
     {
-        uint8_t m = Read(src);
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        X = m;
+        const Instr& instr = cpu.InstrTable[i];
+        if(instr.addr == &Cpu::Addr_ABX_P || instr.addr == &Cpu::Addr_ABY_P || instr.addr == &Cpu::Addr_INY_P)
+        {
+            printf("$%02X %-11s %-5s : %llu of %llu, %.1f%%\n", i, names.Op(instr.code),
+                names.Mode(instr.addr), (unsigned long long) crossed[i],
+                (unsigned long long) executed[i], 100.0 * crossed[i] / executed[i]);
+        }
     }
+}
 
-    void Op_LDY(uint16_t src)
+// Prints runs of pages executed from, written to or both.
+template<CpuModel Model>
+void ReportPages(const mos6502<Model>& cpu)
+{
+    static const char* names[] = { "", "code", "data", "mixed" };
+    int counts[4] = {};
+    for(int page = 0; page < 256; page++)
     {
-        uint8_t m = Read(src);
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Y = m;
+        counts[cpu.Executed(page) | cpu.Written(page) << 1]++;
     }
-
-    void Op_LSR(uint16_t src)
+    printf("PAGES: %d code, %d data, %d mixed\n", counts[1], counts[2], counts[3]);
+    for(int page = 0; page < 256;)
     {
-        uint8_t m = Read(src);
-        SET_CARRY(m & 0x01);
-        m >>= 1;
-        SET_NEGATIVE(0);
-        SET_ZERO(!m);
-        Write(src, m);
+        int kind = cpu.Executed(page) | cpu.Written(page) << 1;
+        int end = page + 1;
+        while(end < 256 && (cpu.Executed(end) | cpu.Written(end) << 1) == kind)
+        {
+            end++;
+        }
+        if(kind)
+        {
+            printf("$%04X-$%04X %s\n", page << 8, (end << 8) - 1, names[kind]);
+        }
+        page = end;
     }
+}
 
-    void Op_LSR_ACC(uint16_t src)
+template<CpuModel Model>
+void Emulate(uint16_t start, size_t size, const Options& options)
+{
+    typedef mos6502<Model> Cpu;
+    UndocumentedPolicy undoc = options.undoc;
+    if(options.aot)
     {
-        uint8_t m = A;
-        SET_CARRY(m & 0x01);
-        m >>= 1;
-        SET_NEGATIVE(0);
-        SET_ZERO(!m);
-        A = m;
+        Recompile<Model>(start, size, options);
     }
-
-    void Op_NOP(uint16_t src)
+    if(options.wcet >= 0)
     {
+        WorstCase<Model>(start, size, options);
     }
-
-    void Op_ORA(uint16_t src)
+    if(options.machines > 0)
     {
-        uint8_t m = Read(src);
-        m = A | m;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        Machines<Model>(start, size, options);
     }
-
-    void Op_PHA(uint16_t src)
+    switch(options.interleave)
     {
-        StackPush(A);
+    case 2: Interleave<Model, 2>(start, size, options); break;
+    case 3: Interleave<Model, 3>(start, size, options); break;
+    case 4: Interleave<Model, 4>(start, size, options); break;
     }
-
-    void Op_PHP(uint16_t src)
+    if(options.timing)
     {
-        StackPush(status | BREAK);
+        Timing<Model>(start, size, options);
     }
-
-    void Op_PLA(uint16_t src)
+    if(!options.inputs.empty())
     {
-        A = StackPop();
-        SET_NEGATIVE(A & 0x80);
-        SET_ZERO(!A);
+        Sweep<Model>(start, size, options);
     }
-
-    void Op_PLP(uint16_t src)
+    Cpu mos { Read, Write };
+    Setup(mos, memory, start, size, options);
+    if(options.save)
     {
-        status = StackPop();
-        SET_CONSTANT(1);
+        SaveAt(mos, options);
     }
-
-    void Op_ROL(uint16_t src)
+    if(options.pages)
     {
-        uint16_t m = Read(src);
-        m <<= 1;
-        if (IF_CARRY()) m |= 0x01;
-        SET_CARRY(m > 0xFF);
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Write(src, m);
+        mos.ClassifyPages();
     }
-
-    void Op_ROL_ACC(uint16_t src)
+    typename Cpu::OpcodeCounter counter;
+    typename Cpu::StatsCounter stats;
+    StopReason reason;
+    if(options.mhz > 0)
     {
-        uint16_t m = A;
-        m <<= 1;
-        if (IF_CARRY()) m |= 0x01;
-        SET_CARRY(m > 0xFF);
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        if(undoc == UNDOC_COUNT)
+        {
+            reason = mos.RunRealtime(options.cycles, options.mhz * 1e6, options.sliceHz, counter);
+        }
+        else
+        {
+            reason = mos.RunRealtime(options.cycles, options.mhz * 1e6, options.sliceHz);
+        }
+        printf("REALTIME: %llu slices, %llu missed, worst %.3f ms late, %llu idle cycles\n",
+            (unsigned long long) mos.slices, (unsigned long long) mos.missedDeadlines,
+            mos.worstLateness * 1e3, (unsigned long long) mos.idleCycles);
     }
-
-    void Op_ROR(uint16_t src)
+    else if(undoc == UNDOC_COUNT)
     {
-        uint16_t m = Read(src);
-        if (IF_CARRY()) m |= 0x100;
-        SET_CARRY(m & 0x01);
-        m >>= 1;
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Write(src, m);
+        reason = mos.Run(options.cycles, counter);
     }
-
-    void Op_ROR_ACC(uint16_t src)
+    else if(options.stats)
+    {
+        reason = mos.Run(options.cycles, stats);
+    }
+    else if(options.checkpoint)
     {
-        uint16_t m = A;
-        if (IF_CARRY()) m |= 0x100;
-        SET_CARRY(m & 0x01);
-        m >>= 1;
-        m &= 0xFF;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        reason = RunCheckpointed(mos, options);
     }
-
-    void Op_RTI(uint16_t src)
+    else if(options.monitor)
     {
-        uint8_t lo, hi;
-
-        status = StackPop();
-
-        lo = StackPop();
-        hi = StackPop();
-
-        pc = (hi << 8) | lo;
+        reason = RunMonitored(mos, options);
     }
-
-    void Op_RTS(uint16_t src)
+    else
     {
-        uint8_t lo, hi;
-
-        lo = StackPop();
-        hi = StackPop();
-        if(sp == 0xFF)
+        Native native;
+#ifdef RUN6502_RECOMPILED
+        if(Model == RUN6502_RECOMPILED)
         {
-            puts("end of stack - emulation complete");
-            puts("ZERO PAGE");
-            int w = 16;
-            for(int j = 0; j < w; j++)
-            {
-                for(int i = 0; i < w; i++)
-                    printf("%02X ", Read(i + w * j));
-                printf("\n");
-            }
-            puts("STACK");
-            for(int j = 0; j < w; j++)
-            {
-                for(int i = 0; i < w; i++)
-                    printf("%02X ", Read(0x1FF - i + w * j));
-                printf("\n");
-            }
-            printf("A  : %3d\n", A);
-            printf("X  : %3d\n", X);
-            printf("Y  : %3d\n", Y);
-            printf("SP : 0x%02X\n", sp);
-            printf("S  : 0x%02X\n", status);
-            printf("PC : 0x%04X\n", pc);
-
-            exit(1);
+            native.setup = run6502_recompiled_setup;
+            native.run = run6502_recompiled;
         }
-        pc = ((hi << 8) | lo) + 1;
+#endif
+        if(options.cache)
+        {
+            native = LoadCached<Model>(start, size, options);
+        }
+        reason = RunNative(mos, options.cycles, native);
     }
-
-    void Op_SBC(uint16_t src)
+    if(undoc == UNDOC_COUNT)
     {
-        uint8_t m = Read(src);
-        unsigned int tmp = A - m - (IF_CARRY() ? 0 : 1);
-        SET_NEGATIVE(tmp & 0x80);
-        SET_ZERO(!(tmp & 0xFF));
-        SET_OVERFLOW(((A ^ tmp) & 0x80) && ((A ^ m) & 0x80));
-
-        if (IF_DECIMAL())
+        puts("UNDOCUMENTED OPCODES");
+        for(int i = 0; i < 256; i++)
         {
-            if ( ((A & 0x0F) - (IF_CARRY() ? 0 : 1)) < (m & 0x0F)) tmp -= 6;
-            if (tmp > 0x99)
+            if(Cpu::Undocumented[i] && counter.count[i] > 0)
             {
-                tmp -= 0x60;
+                printf("$%02X : %llu\n", i, (unsigned long long) counter.count[i]);
             }
         }
-        SET_CARRY(tmp < 0x100);
-        A = (tmp & 0xFF);
     }
-
-    void Op_SEC(uint16_t src)
+    for(int i = 0; i < 256; i++)
     {
-        SET_CARRY(1);
+        const auto& r = mos.regions[i];
+        if(r.count > 0)
+        {
+            printf("REGION %d: count %llu min %llu max %llu mean %.1f cycles\n", i, (unsigned long long) r.count,
+                (unsigned long long) r.min, (unsigned long long) r.max, (double) r.total / r.count);
+        }
     }
-
-    void Op_SED(uint16_t src)
+    if(options.stats)
     {
-        SET_DECIMAL(1);
+        ReportStats(mos, stats);
     }
-
-    void Op_SEI(uint16_t src)
+    if(options.pages)
     {
-        SET_INTERRUPT(1);
+        ReportPages(mos);
     }
-
-    void Op_STA(uint16_t src)
+    Snapshot(options);
+    if(mos.sanitizerReportCount > 0)
     {
-        Write(src, A);
+        printf("SANITIZER: %llu reports\n", (unsigned long long) mos.sanitizerReportCount);
+        for(const auto& r : mos.sanitizerReports)
+        {
+            switch(r.kind)
+            {
+            case Cpu::SAN_UNINIT: printf("uninitialized read of $%04X", r.addr); break;
+            case Cpu::SAN_RETURN: printf("RTS to $%04X, JSR returns to $%04X", r.addr, r.expected); break;
+            case Cpu::SAN_STACK_OVERFLOW: printf("stack overflow"); break;
+            case Cpu::SAN_STACK_UNDERFLOW: printf("stack underflow"); break;
+            }
+            printf(" by $%04X at cycle %llu\n", r.pc, (unsigned long long) r.cycle);
+        }
     }
-
-    void Op_STX(uint16_t src)
+    if(mos.watchHitCount > 0)
     {
-        Write(src, X);
+        printf("WATCHPOINTS: %llu hits\n", (unsigned long long) mos.watchHitCount);
+        for(const auto& hit : mos.watchHits)
+        {
+            const char* kind = hit.kind & Cpu::WATCH_CHANGE ? "change" : hit.kind & Cpu::WATCH_WRITE ? "write" : "read";
+            printf("%-6s $%04X $%02X -> $%02X by $%04X at cycle %llu\n", kind, hit.addr,
+                hit.oldValue, hit.newValue, hit.pc, (unsigned long long) hit.cycle);
+        }
     }
-
-    void Op_STY(uint16_t src)
+    if(reason == STOP_EXIT)
     {
-        Write(src, Y);
+        mos.Dump();
+        if(mos.exitValue >= 0)
+        {
+            printf("EXIT VALUE : 0x%02X\n", mos.exitValue);
+        }
+        exit(1);
     }
-
-    void Op_TAX(uint16_t src)
+    if(reason == STOP_BREAKPOINT || reason == STOP_WATCHPOINT)
     {
-        uint8_t m = A;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        X = m;
+        printf("A=$%02X X=$%02X Y=$%02X SP=$%02X S=$%02X\n", mos.A, mos.X, mos.Y, mos.sp, mos.status);
     }
-
-    void Op_TAY(uint16_t src)
+    if(reason == STOP_ILLEGAL)
     {
-        uint8_t m = A;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        Y = m;
+        printf("STOP: %s $%02X at $%04X after %llu cycles\n", StopReasonName(reason),
+            Read(mos.stopPc), mos.stopPc, (unsigned long long) mos.cycleCount);
     }
-
-    void Op_TSX(uint16_t src)
+    else
     {
-        uint8_t m = sp;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        X = m;
+        printf("STOP: %s at $%04X after %llu cycles\n", StopReasonName(reason),
+            mos.stopPc, (unsigned long long) mos.cycleCount);
     }
+    exit(2);
+}
 
-    void Op_TXA(uint16_t src)
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
     {
-        uint8_t m = X;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        puts("use: ./a.out 0x0300 # PC");
+        puts("     -cpu 6502|65c02|r65c02|w65c02 # CPU model, defaults to 6502");
+        puts("     -undoc allow|count|reject # undocumented NMOS opcodes, defaults to allow");
+        puts("     -irq 20000 # raise an IRQ every so many cycles");
+        puts("     -nmi 20000 # raise an NMI every so many cycles");
+        puts("     -mhz 1.0 # run in real time at this guest clock rate");
+        puts("     -slice 60 # real-time slices per second, defaults to 60");
+        puts("     -cycles 1000000 # stop after this many cycles");
+        puts("     -timeout 2.5 # stop after this many wall clock seconds");
+        puts("     -exit rts|brk|loop|pc:3469|write:FFF0 # when emulation is complete, defaults to rts");
+        puts("     -break 0345[:X==3&&[$10]>2] # stop at an address, optionally only when a condition holds");
+        puts("     -watch rwcs:0010[-001F] # report reads, writes or changes of memory, s to stop at them");
+        puts("     -in b:0010=0-255 -in w:0012=1,0x100 # sweep every combination of input values");
+        puts("     -out b:0020 # sweep output to report, -csv FILE to write the report, -threads N to run on");
+        puts("     -timing [-random N] # report cycle spread and input dependent branches over the -in values");
+        puts("     -aot out.cpp [-entry 0400] # translate the code reachable from the entry points to C++");
+        puts("     -cache DIR # run code translated as for -aot, compiled once and kept in DIR");
+        puts("     -interleave 4 # time 2 to 4 copies run interleaved on one thread against one after another");
+        puts("     -machines 100000[:4] # run that many copies, each with that many pages of memory of its own");
+        puts("     -sparse # give -machines copies all 64K, shared with the image until written");
+        puts("     -dump FILE -diff FILE -hash # write, compare against and hash the 64K of memory at the end");
+        puts("     -save FILE -save-at pc:0400|cycle:5000000 # write a save-state there and stop");
+        puts("     -resume FILE # start from a save-state instead of the reset state");
+        puts("     -checkpoint 1000000 [-keyframe 16] # keep delta checkpoints and report their size");
+        puts("     -monitor /run6502 [-monitor-every 1000000] [-monitor-range 0010-001F] # publish the machine to shared memory");
+        puts("use: ./a.out -view /run6502 # print the updates of a -monitor run until it stops");
+        puts("     -stats # count executions per opcode, addressing mode and Op_ handler, branch outcomes and page crossings");
+        puts("     -pages # report which pages were executed from, written to or both");
+        puts("     -wcet 0300 -loop 0309:8 # bound the cycles of a routine given its loop bounds, checked over -in values");
+        puts("     -timer FF00 # map the cycle counter latch and timing region ports at an address");
+        puts("     -sanitize # report uninitialized reads, mismatched JSR/RTS and stack wrap-around");
+        exit(1);
     }
-
-    void Op_TXS(uint16_t src)
+    if(strcmp(argv[1], "-view") == 0 && argc > 2)
     {
-        sp = X;
+        View(argv[2]);
+        return 0;
     }
-
-    void Op_TYA(uint16_t src)
+    Options options;
+    CpuModel& model = options.model;
+    UndocumentedPolicy& undoc = options.undoc;
+    bool firstExit = true;
+    for(int i = 2; i < argc; i++)
     {
-        uint8_t m = Y;
-        SET_NEGATIVE(m & 0x80);
-        SET_ZERO(!m);
-        A = m;
+        if(strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            if(strcmp(name, "6502") == 0) model = NMOS_6502;
+            else if(strcmp(name, "65c02") == 0) model = CMOS_65C02;
+            else if(strcmp(name, "r65c02") == 0) model = ROCKWELL_65C02;
+            else if(strcmp(name, "w65c02") == 0) model = WDC_65C02;
+            else
+            {
+                printf("error: unknown cpu '%s'\n", name);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-undoc") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            if(strcmp(name, "allow") == 0) undoc = UNDOC_ALLOW;
+            else if(strcmp(name, "count") == 0) undoc = UNDOC_COUNT;
+            else if(strcmp(name, "reject") == 0) undoc = UNDOC_REJECT;
+            else
+            {
+                printf("error: unknown undocumented opcode policy '%s'\n", name);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-irq") == 0 && i + 1 < argc)
+        {
+            options.irqPeriod = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-nmi") == 0 && i + 1 < argc)
+        {
+            options.nmiPeriod = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-mhz") == 0 && i + 1 < argc)
+        {
+            options.mhz = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-slice") == 0 && i + 1 < argc)
+        {
+            options.sliceHz = atof(argv[++i]);
+            if(!(options.sliceHz > 0))
+            {
+                printf("error: -slice takes a rate above 0\n");
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-cycles") == 0 && i + 1 < argc)
+        {
+            options.cycles = strtoll(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-timeout") == 0 && i + 1 < argc)
+        {
+            options.timeout = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-exit") == 0 && i + 1 < argc)
+        {
+            const char* cond = argv[++i];
+            if(!ParseExit(options, cond, firstExit))
+            {
+                printf("error: unknown exit condition '%s'\n", cond);
+                exit(1);
+            }
+            firstExit = false;
+        }
+        else if(strcmp(argv[i], "-break") == 0 && i + 1 < argc)
+        {
+            char* cond;
+            long addr = strtol(argv[++i], &cond, 16);
+            if(cond == argv[i] || addr < 0 || addr > 0xFFFF || (*cond != ':' && *cond != '\0'))
+            {
+                printf("error: -break takes ADDR or ADDR:CONDITION with a hex address up to FFFF\n");
+                exit(1);
+            }
+            options.breakpoints.push_back(std::make_pair((uint16_t) addr, *cond == ':' ? cond + 1 : ""));
+        }
+        else if((strcmp(argv[i], "-in") == 0 || strcmp(argv[i], "-out") == 0) && i + 1 < argc)
+        {
+            bool input = strcmp(argv[i], "-in") == 0;
+            const char* spec = argv[++i];
+            uint64_t runs = SweepRuns(options);
+            if(!ParseSweepVar(input ? options.inputs : options.outputs, spec, input))
+            {
+                printf("error: bad sweep %s '%s'\n", input ? "input" : "output", spec);
+                exit(1);
+            }
+            if(input && options.inputs.back().values.size() > MAX_SWEEP_RUNS / runs)
+            {
+                printf("error: sweep inputs cover more than %llu combinations\n", (unsigned long long) MAX_SWEEP_RUNS);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-aot") == 0 && i + 1 < argc)
+        {
+            options.aot = argv[++i];
+        }
+        else if(strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+        {
+            options.cache = argv[++i];
+        }
+        else if(strcmp(argv[i], "-entry") == 0 && i + 1 < argc)
+        {
+            options.entries.push_back(strtol(argv[++i], NULL, 16));
+        }
+        else if(strcmp(argv[i], "-wcet") == 0 && i + 1 < argc)
+        {
+            options.wcet = strtol(argv[++i], NULL, 16) & 0xFFFF;
+        }
+        else if(strcmp(argv[i], "-loop") == 0 && i + 1 < argc)
+        {
+            char* end;
+            const char* spec = argv[++i];
+            uint16_t header = strtol(spec, &end, 16);
+            if(*end != ':' || strtoull(end + 1, NULL, 10) == 0)
+            {
+                printf("error: bad loop bound '%s'\n", spec);
+                exit(1);
+            }
+            options.loopBounds.push_back({ header, strtoull(end + 1, NULL, 10) });
+        }
+        else if(strcmp(argv[i], "-timing") == 0)
+        {
+            options.timing = true;
+        }
+        else if(strcmp(argv[i], "-random") == 0 && i + 1 < argc)
+        {
+            options.samples = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "-csv") == 0 && i + 1 < argc)
+        {
+            options.csv = argv[++i];
+        }
+        else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            char* end;
+            long threads = strtol(argv[++i], &end, 10);
+            if(end == argv[i] || *end != '\0' || threads < 1 || threads > 1024)
+            {
+                printf("error: -threads takes 1 to 1024 threads\n");
+                exit(1);
+            }
+            options.threads = threads;
+        }
+        else if(strcmp(argv[i], "-timer") == 0 && i + 1 < argc)
+        {
+            options.timer = strtol(argv[++i], NULL, 16) & 0xFFFF;
+        }
+        else if(strcmp(argv[i], "-interleave") == 0 && i + 1 < argc)
+        {
+            options.interleave = atoi(argv[++i]);
+            if(options.interleave < 2 || options.interleave > 4)
+            {
+                printf("error: -interleave takes 2 to 4 machines\n");
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-machines") == 0 && i + 1 < argc)
+        {
+            char* end;
+            options.machines = strtoull(argv[++i], &end, 10);
+            if(*end == ':')
+            {
+                options.machinePages = atoi(end + 1);
+            }
+            if(options.machines == 0 || options.machinePages < 0 || options.machinePages > 256)
+            {
+                printf("error: -machines takes a count and optionally :PAGES from 1 to 256\n");
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-sparse") == 0)
+        {
+            options.sparse = true;
+        }
+        else if(strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
+        {
+            options.dump = argv[++i];
+        }
+        else if(strcmp(argv[i], "-diff") == 0 && i + 1 < argc)
+        {
+            options.diff = argv[++i];
+        }
+        else if(strcmp(argv[i], "-hash") == 0)
+        {
+            options.hashes = true;
+        }
+        else if(strcmp(argv[i], "-save") == 0 && i + 1 < argc)
+        {
+            options.save = argv[++i];
+        }
+        else if(strcmp(argv[i], "-save-at") == 0 && i + 1 < argc)
+        {
+            const char* at = argv[++i];
+            if(strncmp(at, "pc:", 3) == 0)
+            {
+                options.saveAtPc = strtol(at + 3, NULL, 16) & 0xFFFF;
+            }
+            else if(strncmp(at, "cycle:", 6) == 0)
+            {
+                options.saveAtCycle = strtoull(at + 6, NULL, 10);
+            }
+            else
+            {
+                printf("error: -save-at takes pc:HEX or cycle:N\n");
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "-resume") == 0 && i + 1 < argc)
+        {
+            options.resume = argv[++i];
+        }
+        else if(strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+        {
+            options.checkpoint = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "-keyframe") == 0 && i + 1 < argc)
+        {
+            options.keyframe = std::max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "-monitor") == 0 && i + 1 < argc)
+        {
+            options.monitor = argv[++i];
+        }
+        else if(strcmp(argv[i], "-monitor-every") == 0 && i + 1 < argc)
+        {
+            options.monitorEvery = std::max(1ULL, strtoull(argv[++i], NULL, 10));
+        }
+        else if(strcmp(argv[i], "-monitor-range") == 0 && i + 1 < argc)
+        {
+            const char* spec = argv[++i];
+            char* end;
+            unsigned long first = strtoul(spec, &end, 16);
+            unsigned long last = *end == '-' ? strtoul(end + 1, &end, 16) : first;
+            if(*end || first > last || last > 0xFFFF || options.monitorRanges.size() == (size_t) MonitorBlock::maxRanges)
+            {
+                printf("error: bad monitor range '%s'\n", spec);
+                exit(1);
+            }
+            options.monitorRanges.push_back({ (uint16_t) first, (uint16_t) last });
+        }
+        else if(strcmp(argv[i], "-stats") == 0)
+        {
+            options.stats = true;
+        }
+        else if(strcmp(argv[i], "-pages") == 0)
+        {
+            options.pages = true;
+        }
+        else if(strcmp(argv[i], "-sanitize") == 0)
+        {
+            options.sanitize = true;
+        }
+        else if(strcmp(argv[i], "-watch") == 0 && i + 1 < argc)
+        {
+            const char* spec = argv[++i];
+            if(!ParseWatch(options, spec))
+            {
+                printf("error: bad watchpoint '%s'\n", spec);
+                exit(1);
+            }
+        }
+        else
+        {
+            printf("error: unknown option '%s'\n", argv[i]);
+            exit(1);
+        }
     }
-};
-
-uint8_t memory[65536];
-
-void Write(uint16_t i, uint8_t data)
-{
-    memory[i] = data;
-}
-
-uint8_t Read(uint16_t i)
-{
-    return memory[i];
-}
-
-int main(int argc, char* argv[])
-{
-    if(argc != 2)
+    if(options.save && options.saveAtPc < 0 && options.saveAtCycle == 0)
     {
-        puts("use: ./a.out 0x0300 # PC");
+        printf("error: -save needs -save-at\n");
         exit(1);
     }
     const char* in = "out.bin";
@@ -1555,8 +7561,13 @@ int main(int argc, char* argv[])
     }
     fread(memory + start, 1, size, fp);
     fclose(fp);
-    mos6502 mos { Read, Write };
-    mos.Reset(start);
-    uint64_t cycles = 0;
-    mos.Run(INT_MAX, cycles);
+    switch(model)
+    {
+    case NMOS_6502: Emulate<NMOS_6502>(start, size, options); break;
+    case CMOS_65C02: Emulate<CMOS_65C02>(start, size, options); break;
+    case ROCKWELL_65C02: Emulate<ROCKWELL_65C02>(start, size, options); break;
+    case WDC_65C02: Emulate<WDC_65C02>(start, size, options); break;
+    }
 }
+
+#endif
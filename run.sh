@@ -8,8 +8,8 @@ else
     BIN=$(basename $1 .asm).bin
     EMU=emu
     acme --cpu 6502 --setpc $PC -o $BIN $1
-    g++ main.cpp -o $EMU
-    ./$EMU $PC
+    g++ main.cpp -o $EMU -pthread -ldl -DRUN6502_SOURCE="\"$PWD/main.cpp\""
+    ./$EMU $PC "${@:2}"
     echo "-----------------"
     stat -c "SIZE: %5s BYTES" $BIN
     echo "-----------------"